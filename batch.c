@@ -0,0 +1,387 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "game.h"
+#include "simulation.h"
+#include "replay.h"
+#include "util.h"
+
+/*
+ * Batch runner: plays many (cave, difficulty level, seed, input script)
+ * jobs headless on a work-stealing thread pool and writes one CSV row per
+ * job.
+ *
+ *   boulder-dash-batch [-j threads] jobs.txt results.csv
+ *
+ * Each line of the job file is "cave difficulty seed [script.bdr]", with
+ * cave 0..19 in CaveName order and difficulty 0..4. The script supplies
+ * the input of every tick; without one Rockford stands still. A job ends
+ * when the cave is completed, Rockford dies, time runs out, the script
+ * ends or BATCH_MAX_TICKS have passed.
+ */
+
+#define BATCH_MAX_TICKS 20000
+#define BATCH_MAX_PATH 256
+
+typedef enum
+{
+    OUTCOME_COMPLETED, OUTCOME_DIED, OUTCOME_OUT_OF_TIME, OUTCOME_UNFINISHED
+} Outcome;
+
+const char *outcomeNames[] =
+{
+    [ OUTCOME_COMPLETED ] = "completed",
+    [ OUTCOME_DIED ] = "died",
+    [ OUTCOME_OUT_OF_TIME ] = "out_of_time",
+    [ OUTCOME_UNFINISHED ] = "unfinished",
+};
+
+typedef struct
+{
+    int cave;
+    int difficultyLevel;
+    uint32_t seed;
+    int script;     // Index into scripts, or -1 for no input
+
+    // Results
+    Outcome outcome;
+    int score;
+    int diamondsCollected;
+    int ticks;
+    int turns;
+} Job;
+
+// Job indices owned by one worker. The owner takes from the bottom,
+// thieves take from the top.
+typedef struct
+{
+    pthread_mutex_t lock;
+    int *jobs;
+    int top;
+    int bottom;
+} JobDeque;
+
+typedef struct
+{
+    GameState state;    // First, so every worker's state starts on its own cache line
+    JobDeque deque;
+    uint32_t stealSeed;
+    int jobsRun;
+    int jobsStolen;
+} Worker;
+
+Job *jobs;
+int jobCount;
+char (*scriptPaths)[BATCH_MAX_PATH];
+Replay *scripts;
+int scriptCount;
+Worker *workers;
+int workerCount;
+
+//
+// Jobs
+//
+
+void runJob(GameState *state, Job *job)
+{
+    const Replay *script = job->script >= 0 ? &scripts[job->script] : NULL;
+    uint32_t run = 0;
+    int ticksLeftInRun = script && script->runCount > 0 ? script->runs[0].lengthMinusOne + 1 : 0;
+
+    initGameState( state, job->cave, job->difficultyLevel, job->seed );
+    job->outcome = OUTCOME_UNFINISHED;
+
+    while( state->tick < BATCH_MAX_TICKS )
+    {
+        Input input = 0;
+        if( script )
+        {
+            if( ticksLeftInRun == 0 )
+            {
+                if( ++run >= script->runCount )
+                {
+                    break;
+                }
+                ticksLeftInRun = script->runs[run].lengthMinusOne + 1;
+            }
+            input = script->runs[run].input;
+            --ticksLeftInRun;
+        }
+
+        stepGame( state, input );
+
+        // The cave ends once the time bonus has been added
+        if( state->isExitingCave )
+        {
+            job->outcome = OUTCOME_COMPLETED;
+            break;
+        }
+        if( state->turnsSinceRockfordSeenAlive >= 16 )
+        {
+            job->outcome = OUTCOME_DIED;
+            break;
+        }
+        if( state->isOutOfTime )
+        {
+            job->outcome = OUTCOME_OUT_OF_TIME;
+            break;
+        }
+        if( state->tileCoverTicksLeft > 0 )
+        {
+            job->outcome = OUTCOME_DIED;    // Gave up with the fail key
+            break;
+        }
+    }
+
+    job->score = state->score;
+    job->diamondsCollected = state->diamondsCollected;
+    job->ticks = state->tick;
+    job->turns = state->turn;
+}
+
+int findScript(const char *path)
+{
+    for( int i = 0; i < scriptCount; ++i )
+    {
+        if( strcmp( scriptPaths[i], path ) == 0 )
+        {
+            return i;
+        }
+    }
+
+    scriptPaths = realloc( scriptPaths, (scriptCount + 1) * sizeof(*scriptPaths) );
+    scripts = realloc( scripts, (scriptCount + 1) * sizeof(*scripts) );
+    assert( scriptPaths && scripts );
+
+    if( !loadReplay( &scripts[scriptCount], path ) )
+    {
+        printf( "Could not load input script %s\n", path );
+        exit( -1 );
+    }
+    snprintf( scriptPaths[scriptCount], BATCH_MAX_PATH, "%s", path );
+
+    return scriptCount++;
+}
+
+bool loadJobs(const char *path)
+{
+    FILE *file = fopen( path, "r" );
+    if( !file )
+    {
+        return false;
+    }
+
+    char line[BATCH_MAX_PATH + 64];
+    int capacity = 0;
+
+    while( fgets( line, sizeof(line), file ) )
+    {
+        Job job = { 0 };
+        char script[BATCH_MAX_PATH] = "";
+
+        int fields = sscanf( line, "%d %d %u %255s", &job.cave, &job.difficultyLevel, &job.seed, script );
+        if( fields < 3 )
+        {
+            continue;   // Blank line or comment
+        }
+        if( job.cave < 0 || job.cave >= CAVE_COUNT || job.difficultyLevel < 0
+                || job.difficultyLevel >= NUM_DIFFICULTY_LEVELS )
+        {
+            printf( "Bad job: %s", line );
+            exit( -1 );
+        }
+        job.script = fields == 4 ? findScript( script ) : -1;
+
+        if( jobCount == capacity )
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            jobs = realloc( jobs, capacity * sizeof(*jobs) );
+            assert( jobs );
+        }
+        jobs[jobCount++] = job;
+    }
+
+    fclose( file );
+    return true;
+}
+
+bool saveResults(const char *path)
+{
+    FILE *file = fopen( path, "w" );
+    if( !file )
+    {
+        return false;
+    }
+
+    fprintf( file, "job,cave,difficulty,seed,script,outcome,score,diamonds,ticks,turns\n" );
+    for( int i = 0; i < jobCount; ++i )
+    {
+        Job *job = &jobs[i];
+        fprintf( file, "%d,%d,%d,%u,%s,%s,%d,%d,%d,%d\n", i, job->cave, job->difficultyLevel, job->seed,
+                job->script >= 0 ? scriptPaths[job->script] : "", outcomeNames[job->outcome], job->score,
+                job->diamondsCollected, job->ticks, job->turns );
+    }
+
+    return fclose( file ) == 0;
+}
+
+//
+// Work-stealing scheduler
+//
+
+bool popJob(JobDeque *deque, int *job)
+{
+    pthread_mutex_lock( &deque->lock );
+    bool found = deque->bottom > deque->top;
+    if( found )
+    {
+        *job = deque->jobs[--deque->bottom];
+    }
+    pthread_mutex_unlock( &deque->lock );
+    return found;
+}
+
+bool stealJob(JobDeque *deque, int *job)
+{
+    pthread_mutex_lock( &deque->lock );
+    bool found = deque->bottom > deque->top;
+    if( found )
+    {
+        *job = deque->jobs[deque->top++];
+    }
+    pthread_mutex_unlock( &deque->lock );
+    return found;
+}
+
+// Jobs never create jobs, so once every deque has been found empty the
+// worker is done
+bool stealFromOthers(Worker *thief, int *job)
+{
+    thief->stealSeed = thief->stealSeed * 1103515245u + 12345u;
+    int first = (thief->stealSeed >> 16) % workerCount;
+
+    for( int i = 0; i < workerCount; ++i )
+    {
+        Worker *victim = &workers[(first + i) % workerCount];
+        if( victim != thief && stealJob( &victim->deque, job ) )
+        {
+            ++thief->jobsStolen;
+            return true;
+        }
+    }
+    return false;
+}
+
+void *workerMain(void *arg)
+{
+    Worker *worker = arg;
+    int job;
+
+    while( popJob( &worker->deque, &job ) || stealFromOthers( worker, &job ) )
+    {
+        runJob( &worker->state, &jobs[job] );
+        ++worker->jobsRun;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int arg = 1;
+
+    workerCount = (int) sysconf( _SC_NPROCESSORS_ONLN );
+    if( argc > arg + 1 && strcmp( argv[arg], "-j" ) == 0 )
+    {
+        workerCount = atoi( argv[arg + 1] );
+        arg += 2;
+    }
+    if( workerCount < 1 )
+    {
+        workerCount = 1;
+    }
+
+    if( argc != arg + 2 )
+    {
+        printf( "Usage: %s [-j threads] jobs.txt results.csv\n", argv[0] );
+        return -1;
+    }
+
+    if( !loadJobs( argv[arg] ) )
+    {
+        printf( "Could not read jobs from %s\n", argv[arg] );
+        return -1;
+    }
+
+    //
+    // Deal the jobs out in contiguous blocks, stealing evens out the rest
+    //
+
+    size_t workersSize = (workerCount * sizeof(Worker) + CACHE_LINE_SIZE - 1)
+            / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    workers = aligned_alloc( CACHE_LINE_SIZE, workersSize );
+    int *jobOrder = malloc( (jobCount + 1) * sizeof(*jobOrder) );
+    assert( workers && jobOrder );
+
+    for( int i = 0; i < jobCount; ++i )
+    {
+        jobOrder[i] = i;
+    }
+
+    for( int i = 0; i < workerCount; ++i )
+    {
+        Worker *worker = &workers[i];
+        memset( worker, 0, sizeof(*worker) );
+        pthread_mutex_init( &worker->deque.lock, NULL );
+        worker->deque.jobs = jobOrder;
+        worker->deque.top = (int) ((int64_t) jobCount * i / workerCount);
+        worker->deque.bottom = (int) ((int64_t) jobCount * (i + 1) / workerCount);
+        worker->stealSeed = i + 1;
+    }
+
+    //
+    // Run
+    //
+
+    uint64_t start = timer_tick();
+
+    pthread_t *threads = malloc( workerCount * sizeof(*threads) );
+    assert( threads );
+    for( int i = 0; i < workerCount; ++i )
+    {
+        int rslt = pthread_create( &threads[i], NULL, workerMain, &workers[i] );
+        assert( 0 == rslt );
+    }
+
+    int jobsStolen = 0;
+    for( int i = 0; i < workerCount; ++i )
+    {
+        pthread_join( threads[i], NULL );
+        jobsStolen += workers[i].jobsStolen;
+    }
+
+    double seconds = (double) timer_get_relative( start ) / 1e9;
+
+    uint64_t turns = 0;
+    for( int i = 0; i < jobCount; ++i )
+    {
+        turns += jobs[i].turns;
+    }
+
+    printf( "%d jobs on %d threads (%d stolen), %llu turns in %.3f s: %.0f turns/s\n", jobCount, workerCount,
+            jobsStolen, (unsigned long long) turns, seconds, turns / seconds );
+
+    if( !saveResults( argv[arg + 1] ) )
+    {
+        printf( "Could not write results to %s\n", argv[arg + 1] );
+        return -1;
+    }
+
+    return 0;
+}
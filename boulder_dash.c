@@ -4,14 +4,25 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <signal.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define ARRAY_LENGTH(array) (sizeof(array)/sizeof(*array))
 
 #define RGBAQUADV(b,g,r,a) (((uint32_t)b)<<24|((uint32_t)g)<<16|((uint32_t)r)<<8|(uint32_t)a)
 
 #include "data_sprites.h"
-#include "data_caves.h"
 #include "game.h"
+#include "simulation.h"
+#include "replay.h"
+#include "input.h"
+#include "sound.h"
 #include "util.h"
 
 const RGBQUAD black = RGBAQUADV( 0x00, 0x00, 0x00, 0xff );
@@ -37,111 +48,6 @@ RGBQUAD bmiColors[ COLOR_COUNT ] =
     [ WHITE  ] = white,
 };
 
-typedef enum
-{
-    OBJ_SPACE = 0x00,
-    OBJ_DIRT = 0x01,
-    OBJ_BRICK_WALL = 0x02,
-    OBJ_MAGIC_WALL = 0x03,
-    OBJ_PRE_OUTBOX = 0x04,
-    OBJ_FLASHING_OUTBOX = 0x05,
-    OBJ_STEEL_WALL = 0x07,
-    OBJ_FIREFLY_LEFT = 0x08,
-    OBJ_FIREFLY_UP = 0x09,
-    OBJ_FIREFLY_RIGHT = 0x0A,
-    OBJ_FIREFLY_DOWN = 0x0B,
-    OBJ_FIREFLY_LEFT_SCANNED = 0x0C,
-    OBJ_FIREFLY_UP_SCANNED = 0x0D,
-    OBJ_FIREFLY_RIGHT_SCANNED = 0x0E,
-    OBJ_FIREFLY_DOWN_SCANNED = 0x0F,
-    OBJ_BOULDER_STATIONARY = 0x10,
-    OBJ_BOULDER_STATIONARY_SCANNED = 0x11,
-    OBJ_BOULDER_FALLING = 0x12,
-    OBJ_BOULDER_FALLING_SCANNED = 0x13,
-    OBJ_DIAMOND_STATIONARY = 0x14,
-    OBJ_DIAMOND_STATIONARY_SCANNED = 0x15,
-    OBJ_DIAMOND_FALLING = 0x16,
-    OBJ_DIAMOND_FALLING_SCANNED = 0x17,
-    OBJ_EXPLODE_TO_SPACE_0 = 0x1B,
-    OBJ_EXPLODE_TO_SPACE_1 = 0x1C,
-    OBJ_EXPLODE_TO_SPACE_2 = 0x1D,
-    OBJ_EXPLODE_TO_SPACE_3 = 0x1E,
-    OBJ_EXPLODE_TO_SPACE_4 = 0x1F,
-    OBJ_EXPLODE_TO_DIAMOND_0 = 0x20,
-    OBJ_EXPLODE_TO_DIAMOND_1 = 0x21,
-    OBJ_EXPLODE_TO_DIAMOND_2 = 0x22,
-    OBJ_EXPLODE_TO_DIAMOND_3 = 0x23,
-    OBJ_EXPLODE_TO_DIAMOND_4 = 0x24,
-    OBJ_PRE_ROCKFORD_1 = 0x25,
-    OBJ_PRE_ROCKFORD_2 = 0x26,
-    OBJ_PRE_ROCKFORD_3 = 0x27,
-    OBJ_PRE_ROCKFORD_4 = 0x28,
-    OBJ_BUTTERFLY_DOWN = 0x30,
-    OBJ_BUTTERFLY_LEFT = 0x31,
-    OBJ_BUTTERFLY_UP = 0x32,
-    OBJ_BUTTERFLY_RIGHT = 0x33,
-    OBJ_BUTTERFLY_DOWN_SCANNED = 0x34,
-    OBJ_BUTTERFLY_LEFT_SCANNED = 0x35,
-    OBJ_BUTTERFLY_UP_SCANNED = 0x36,
-    OBJ_BUTTERFLY_RIGHT_SCANNED = 0x37,
-    OBJ_ROCKFORD = 0x38,
-    OBJ_ROCKFORD_SCANNED = 0x39,
-    OBJ_AMOEBA = 0x3A,
-    OBJ_AMOEBA_SCANNED = 0x3B,
-} Object;
-
-typedef enum
-{
-    OBJST_SINGLE, OBJST_LINE, OBJST_FILLED_RECT, OBJST_RECT,
-} ObjectStructure;
-
-#define CAVE_HEIGHT 22
-#define CAVE_WIDTH 40
-#define NUM_DIFFICULTY_LEVELS 5
-#define NUM_RANDOM_OBJECTS 4
-
-typedef struct
-{
-    uint8_t caveNumber;
-    uint8_t magicWallMillingTime; // also amoebaSlowGrowthTime
-    uint8_t initialDiamondValue;
-    uint8_t extraDiamondValue;
-    uint8_t randomiserSeed[NUM_DIFFICULTY_LEVELS];
-    uint8_t diamondsNeeded[NUM_DIFFICULTY_LEVELS];
-    uint8_t caveTime[NUM_DIFFICULTY_LEVELS];
-    uint8_t backgroundColor1;
-    uint8_t backgroundColor2;
-    uint8_t foregroundColor;
-    uint8_t unused[2];
-    uint8_t randomObject[NUM_RANDOM_OBJECTS];
-    uint8_t objectProbability[NUM_RANDOM_OBJECTS];
-} CaveInfo;
-
-typedef enum
-{
-    CAVE_A,
-    CAVE_B,
-    CAVE_C,
-    CAVE_D,
-    INTERMISSION_1,
-    CAVE_E,
-    CAVE_F,
-    CAVE_G,
-    CAVE_H,
-    INTERMISSION_2,
-    CAVE_I,
-    CAVE_J,
-    CAVE_K,
-    CAVE_L,
-    INTERMISSION_3,
-    CAVE_M,
-    CAVE_N,
-    CAVE_O,
-    CAVE_P,
-    INTERMISSION_4,
-    CAVE_COUNT,
-} CaveName;
-
 typedef struct
 {
     Color boulderFg;
@@ -152,35 +58,11 @@ typedef struct
     Color flyBg;
 } CaveColors;
 
-typedef enum
-{
-    UP, DOWN, LEFT, RIGHT, DIRECTION_COUNT
-} Direction;
-typedef enum
-{
-    TURN_LEFT, STRAIGHT_AHEAD, TURN_RIGHT
-} Turning;
-typedef enum
-{
-    MAGIC_WALL_OFF, MAGIC_WALL_ON, MAGIC_WALL_EXPIRED
-} MagicWallStatus;
-
 //
 // Global variables
 //
 
-volatile uint32_t *backbuffer;
-uint8_t map[ CAVE_HEIGHT ][ CAVE_WIDTH ];
-CaveInfo *caveInfo;
-int turnsSinceRockfordSeenAlive;
-bool isOutOfTime;
-int livesLeft;
-int difficultyLevel;
-int score;
-int scoreTillBonusLife;
-int spaceFlashingTurnsLeft;
-int currentCaveNumber;
-MagicWallStatus magicWallStatus;
+volatile uint8_t *backbuffer;    // One Color index per pixel
 
 ///////////////
 
@@ -197,7 +79,7 @@ void setPixel(int x, int y, Color color)
 
 //    assert( pixelOffset >= 0 && pixelOffset < BACKBUFFER_BYTES );
 
-    backbuffer[ pixelOffset ] = bmiColors[ color ];
+    backbuffer[ pixelOffset ] = color;
 }
 
 void drawRect(int left, int top, int right, int bottom, Color color)
@@ -216,680 +98,1602 @@ void drawRect(int left, int top, int right, int bottom, Color color)
 
 void drawFilledRect(int left, int top, int right, int bottom, Color color)
 {
+    assert( color < COLOR_COUNT );
+
     for( int y = top; y <= bottom; ++y )
     {
-        for( int x = left; x <= right; ++x )
+        memset( (void*) &backbuffer[ y * BACKBUFFER_WIDTH + left ], color, right - left + 1 );
+    }
+}
+
+//
+// Tile expansion
+//
+// Turns the eight rows of a 1-bit tile, starting vOffset rows in, into one
+// Color index per pixel. The SSE2 and AVX2 versions build two and four
+// pixel rows at a time with a compare and blend against per-pixel bit
+// masks. expandTile starts out pointing at a selector that picks the best
+// version the CPU supports on first use, so one binary runs on any x86-64.
+//
+
+typedef void (*ExpandTileFunc)(const uint8_t *tile, int vOffset, uint8_t fg, uint8_t bg,
+        uint8_t *dst, int dstStride);
+
+void expandTileScalar(const uint8_t *tile, int vOffset, uint8_t fg, uint8_t bg, uint8_t *dst, int dstStride)
+{
+    for( int bmpY = 0; bmpY < TILE_SIZE; ++bmpY )
+    {
+        uint8_t byte = tile[ (bmpY + vOffset) % TILE_SIZE ];
+
+        for( int bmpX = 0; bmpX < TILE_SIZE; ++bmpX )
         {
-            setPixel( x, y, color );
+            dst[ bmpX ] = (byte & (0x80 >> bmpX)) ? fg : bg;
         }
+        dst += dstStride;
     }
 }
 
-void drawTile(uint8_t *tile, int dstX, int dstY, Color fgColor, Color bgColor, int vOffset)
+#if defined(__x86_64__)
+
+// Repeats a tile row byte across all eight bytes of a pixel row
+#define SPREAD_ROW(byte) ((int64_t) ((byte) * 0x0101010101010101ULL))
+
+void expandTileSse2(const uint8_t *tile, int vOffset, uint8_t fg, uint8_t bg, uint8_t *dst, int dstStride)
 {
-    for( uint8_t bmpY = 0; bmpY < TILE_SIZE; ++bmpY )
+    const __m128i bits = _mm_set_epi8( 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char) 0x80,
+            0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char) 0x80 );
+    __m128i fgPixels = _mm_set1_epi8( (char) fg );
+    __m128i bgPixels = _mm_set1_epi8( (char) bg );
+
+    for( int bmpY = 0; bmpY < TILE_SIZE; bmpY += 2 )
     {
-        int y = dstY + bmpY;
-        uint8_t byte = tile[(bmpY + vOffset) % TILE_SIZE];
+        __m128i rows = _mm_set_epi64x( SPREAD_ROW( tile[ (bmpY + 1 + vOffset) % TILE_SIZE ] ),
+                SPREAD_ROW( tile[ (bmpY + vOffset) % TILE_SIZE ] ) );
+        __m128i isSet = _mm_cmpeq_epi8( _mm_and_si128( rows, bits ), bits );
+        __m128i pixels = _mm_or_si128( _mm_and_si128( isSet, fgPixels ),
+                _mm_andnot_si128( isSet, bgPixels ) );
+
+        _mm_storel_epi64( (__m128i*) dst, pixels );
+        _mm_storel_epi64( (__m128i*) (dst + dstStride), _mm_unpackhi_epi64( pixels, pixels ) );
+        dst += 2 * dstStride;
+    }
+}
+
+__attribute__((target("avx2")))
+void expandTileAvx2(const uint8_t *tile, int vOffset, uint8_t fg, uint8_t bg, uint8_t *dst, int dstStride)
+{
+    const __m256i bits = _mm256_set1_epi64x( 0x0102040810204080LL );
+    __m256i fgPixels = _mm256_set1_epi8( (char) fg );
+    __m256i bgPixels = _mm256_set1_epi8( (char) bg );
+
+    for( int bmpY = 0; bmpY < TILE_SIZE; bmpY += 4 )
+    {
+        __m256i rows = _mm256_set_epi64x( SPREAD_ROW( tile[ (bmpY + 3 + vOffset) % TILE_SIZE ] ),
+                SPREAD_ROW( tile[ (bmpY + 2 + vOffset) % TILE_SIZE ] ),
+                SPREAD_ROW( tile[ (bmpY + 1 + vOffset) % TILE_SIZE ] ),
+                SPREAD_ROW( tile[ (bmpY + vOffset) % TILE_SIZE ] ) );
+        __m256i isSet = _mm256_cmpeq_epi8( _mm256_and_si256( rows, bits ), bits );
+        __m256i pixels = _mm256_blendv_epi8( bgPixels, fgPixels, isSet );
+        __m128i low = _mm256_castsi256_si128( pixels );
+        __m128i high = _mm256_extracti128_si256( pixels, 1 );
+
+        _mm_storel_epi64( (__m128i*) dst, low );
+        _mm_storel_epi64( (__m128i*) (dst + dstStride), _mm_unpackhi_epi64( low, low ) );
+        _mm_storel_epi64( (__m128i*) (dst + 2 * dstStride), high );
+        _mm_storel_epi64( (__m128i*) (dst + 3 * dstStride), _mm_unpackhi_epi64( high, high ) );
+        dst += 4 * dstStride;
+    }
+}
+
+#endif
 
-        for( uint8_t bmpX = 0; bmpX < TILE_SIZE; ++bmpX )
+void expandTileSelect(const uint8_t *tile, int vOffset, uint8_t fg, uint8_t bg, uint8_t *dst, int dstStride);
+
+ExpandTileFunc expandTile = expandTileSelect;
+
+void expandTileSelect(const uint8_t *tile, int vOffset, uint8_t fg, uint8_t bg, uint8_t *dst, int dstStride)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    expandTile = __builtin_cpu_supports( "avx2" ) ? expandTileAvx2 : expandTileSse2;
+#else
+    expandTile = expandTileScalar;
+#endif
+
+    expandTile( tile, vOffset, fg, bg, dst, dstStride );
+}
+
+//
+// Sprite cache
+//
+// Each (sprite, frame, foreground, background) combination is expanded to
+// Color indices the first time it is drawn, so drawing a cached sprite is
+// one row copy per pixel row. All the caves together need fewer than 600
+// combinations: every caveColors entry with the cave sprites, plus the
+// shared Rockford, diamond, explosion, amoeba and font sprites.
+//
+
+#define SPRITE_CACHE_SLOTS 1024 // Power of two
+
+typedef struct
+{
+    const uint8_t *sprite;
+    int frame;
+    Color fgColor;
+    Color bgColor;
+} SpriteCacheKey;
+
+SpriteCacheKey spriteCacheKeys[ SPRITE_CACHE_SLOTS ];
+uint8_t spriteCachePixels[ SPRITE_CACHE_SLOTS ][ CELL_SIZE * CELL_SIZE ];
+
+// Expands one frame of a sprite, scrolled up by vOffset rows within each tile
+void expandSprite(const uint8_t *sprite, int frame, Color fgColor, Color bgColor, int vOffset,
+        uint8_t *pixels, int stride)
+{
+    assert( fgColor < COLOR_COUNT && bgColor < COLOR_COUNT );
+
+    int size = sprite[ 1 ];
+    const uint8_t *data = sprite + 2 + frame * size * size * TILE_SIZE;
+    for( int row = 0; row < size; ++row )
+    {
+        for( int col = 0; col < size; ++col )
         {
-            int x = dstX + bmpX;
-            uint8_t mask = 1 << ((TILE_SIZE - 1) - bmpX);
-            uint8_t bit = byte & mask;
-            Color color = bit ? fgColor : bgColor;
+            expandTile( data, vOffset, fgColor, bgColor, pixels + row * TILE_SIZE * stride + col * TILE_SIZE,
+                    stride );
+            data += TILE_SIZE;
+        }
+    }
+}
+
+// Returns the expanded pixels, or NULL when the cache is full
+const uint8_t *getCachedSprite(const uint8_t *sprite, int frame, Color fgColor, Color bgColor)
+{
+    uint32_t hash = (uint32_t) (uintptr_t) sprite * 0x9E3779B1u;
+    hash ^= (frame * COLOR_COUNT + fgColor) * COLOR_COUNT + bgColor;
+    hash *= 0x85EBCA6Bu;
+
+    for( int probe = 0; probe < SPRITE_CACHE_SLOTS; ++probe )
+    {
+        int slot = (hash + probe) & (SPRITE_CACHE_SLOTS - 1);
+        SpriteCacheKey *key = &spriteCacheKeys[ slot ];
 
-            setPixel( x, y, color );
+        if( key->sprite == sprite && key->frame == frame
+                && key->fgColor == fgColor && key->bgColor == bgColor )
+        {
+            return spriteCachePixels[ slot ];
+        }
+        if( key->sprite == NULL )
+        {
+            expandSprite( sprite, frame, fgColor, bgColor, 0, spriteCachePixels[ slot ],
+                    sprite[ 1 ] * TILE_SIZE );
+            *key = (SpriteCacheKey) { sprite, frame, fgColor, bgColor };
+            return spriteCachePixels[ slot ];
         }
     }
+
+    return NULL;
 }
 
+// Draws the part of a sprite that lies inside the viewport
 void drawSprite(uint8_t *sprite, int frame, int dstX, int dstY, Color fgColor, Color bgColor, int vOffset)
 {
     int frames = sprite[ 0 ];
-    int size = sprite[ 1 ];
-    int bytesPerFrame = size * size * TILE_SIZE;
-    int bytesPerRow = size * TILE_SIZE;
+    int width = sprite[ 1 ] * TILE_SIZE;
 
-    for( int row = 0; row < size; ++row )
+    int left = dstX > VIEWPORT_LEFT ? dstX : VIEWPORT_LEFT;
+    int top = dstY > VIEWPORT_TOP ? dstY : VIEWPORT_TOP;
+    int right = dstX + width - 1 < VIEWPORT_RIGHT ? dstX + width - 1 : VIEWPORT_RIGHT;
+    int bottom = dstY + width - 1 < VIEWPORT_BOTTOM ? dstY + width - 1 : VIEWPORT_BOTTOM;
+
+    if( left > right || top > bottom )
     {
-        for( int col = 0; col < size; ++col )
+        return;
+    }
+
+    // Scrolling sprites are expanded on the spot, everything else comes from the cache
+    uint8_t expanded[ CELL_SIZE * CELL_SIZE ];
+    const uint8_t *pixels = vOffset == 0 ? getCachedSprite( sprite, frame % frames, fgColor, bgColor ) : NULL;
+
+    if( !pixels )
+    {
+        assert( width <= CELL_SIZE );
+        expandSprite( sprite, frame % frames, fgColor, bgColor, vOffset % TILE_SIZE, expanded, width );
+        pixels = expanded;
+    }
+
+    for( int y = top; y <= bottom; ++y )
+    {
+        memcpy( (void*) &backbuffer[ y * BACKBUFFER_WIDTH + left ],
+                pixels + (y - dstY) * width + (left - dstX), right - left + 1 );
+    }
+}
+
+//
+// Replays
+//
+
+Replay recording;
+const char *recordingPath;
+const GameState *recordingState;
+
+void saveRecording( void )
+{
+    finishReplay( &recording, recordingState );
+    if( !saveReplay( &recording, recordingPath ) )
+    {
+        printf( "Could not save replay to %s\n", recordingPath );
+    }
+    freeReplay( &recording );
+}
+
+// Plays every replay back as fast as possible and checks it ends in the recorded state
+int verifyReplays(int count, char *paths[])
+{
+    static GameState state;
+    int failures = 0;
+    uint64_t turns = 0;
+    uint64_t start = timer_tick();
+
+    for( int i = 0; i < count; ++i )
+    {
+        Replay replay;
+        if( !loadReplay( &replay, paths[i] ) )
+        {
+            printf( "%s: could not load\n", paths[i] );
+            ++failures;
+            continue;
+        }
+
+        bool matches = playReplay( &replay, &state );
+        printf( "%s: %s, %u ticks, score %d\n", paths[i], matches ? "OK" : "MISMATCH", replay.tickCount,
+                state.score );
+
+        failures += !matches;
+        turns += state.turn;
+        freeReplay( &replay );
+    }
+
+    double seconds = (double) timer_get_relative( start ) / 1e9;
+    printf( "%d replays, %d failed, %llu turns in %.3f s: %.0f turns/s\n", count, failures,
+            (unsigned long long) turns, seconds, turns / seconds );
+
+    return failures ? 1 : 0;
+}
+
+//
+// Cave cells
+//
+// What a cell looks like is worked out apart from drawing it, so the
+// renderer can compare it with what it drew there last frame.
+//
+
+typedef struct
+{
+    uint8_t *sprite;    // NULL when the border shows through, in fgColor
+    int frame;
+    Color fgColor;
+    Color bgColor;
+    int vOffset;
+} CellVisual;
+
+CellVisual cellVisual(uint8_t *sprite, int frame, Color fgColor, Color bgColor, int vOffset)
+{
+    return (CellVisual) { sprite, frame % sprite[ 0 ], fgColor, bgColor, vOffset % TILE_SIZE };
+}
+
+bool isSameCellVisual(const CellVisual *a, const CellVisual *b)
+{
+    return a->sprite == b->sprite && a->frame == b->frame && a->fgColor == b->fgColor
+            && a->bgColor == b->bgColor && a->vOffset == b->vOffset;
+}
+
+CellVisual getObjectVisual(const GameState *state, const CaveColors *colors, uint8_t object)
+{
+    CellVisual visual = { .fgColor = state->borderColor };
+
+    switch( object )
+    {
+    case OBJ_SPACE:
+        if( state->spaceFlashingTurnsLeft > 0 && !state->isAddingTimeToScore
+                && state->turnsTillExitingCave == 0 )
+        {
+            visual = cellVisual( spriteSpaceFlash, state->turn, WHITE, BLACK, 0 );
+        }
+        else
+        {
+            visual = cellVisual( spriteSpace, 0, BLACK, BLACK, 0 );
+        }
+        break;
+
+    case OBJ_STEEL_WALL:
+    case OBJ_PRE_OUTBOX:
+        visual = cellVisual( spriteSteelWall, 0, colors->boulderFg, BLACK, 0 );
+        break;
+
+    case OBJ_FLASHING_OUTBOX:
+        if( state->turn % 2 == 0 )
         {
-            int x = dstX + col * TILE_SIZE;
-            int y = dstY + row * TILE_SIZE;
+            visual = cellVisual( spriteOutbox, 0, colors->boulderFg, BLACK, 0 );
+        }
+        else
+        {
+            visual = cellVisual( spriteSteelWall, 0, colors->boulderFg, BLACK, 0 );
+        }
+        break;
+
+    case OBJ_DIRT:
+        visual = cellVisual( spriteDirt, 0, colors->dirtFg, BLACK, 0 );
+        break;
+
+    case OBJ_BRICK_WALL:
+        visual = cellVisual( spriteBrickWall, 0, colors->brickWallFg, colors->brickWallBg, 0 );
+        break;
+
+    case OBJ_MAGIC_WALL:
+    {
+        int frame = (state->magicWallStatus == MAGIC_WALL_ON) ? state->turn : 0;
+        visual = cellVisual( spriteBrickWall, frame, colors->brickWallFg, colors->brickWallBg, 0 );
+        break;
+    }
+
+    case OBJ_BOULDER_STATIONARY:
+    case OBJ_BOULDER_FALLING:
+        visual = cellVisual( spriteBoulder, 0, colors->boulderFg, BLACK, 0 );
+        break;
+
+    case OBJ_DIAMOND_STATIONARY:
+    case OBJ_DIAMOND_FALLING:
+        visual = cellVisual( spriteDiamond, state->turn, WHITE, BLACK, 0 );
+        break;
+
+    case OBJ_FIREFLY_LEFT:
+    case OBJ_FIREFLY_UP:
+    case OBJ_FIREFLY_RIGHT:
+    case OBJ_FIREFLY_DOWN:
+        visual = cellVisual( spriteFirefly, state->turn, colors->flyFg, colors->flyBg, 0 );
+        break;
+
+    case OBJ_BUTTERFLY_LEFT:
+    case OBJ_BUTTERFLY_UP:
+    case OBJ_BUTTERFLY_RIGHT:
+    case OBJ_BUTTERFLY_DOWN:
+        visual = cellVisual( spriteButterfly, state->turn, colors->flyFg, colors->flyBg, 0 );
+        break;
+
+        //
+        // Draw Rockford birth
+        //
 
-            if( x >= VIEWPORT_LEFT && (x + TILE_SIZE - 1) <= VIEWPORT_RIGHT && y >= VIEWPORT_TOP &&
-                    (y + TILE_SIZE - 1) <= VIEWPORT_BOTTOM )
+    case OBJ_PRE_ROCKFORD_1:
+        if( state->rockfordTurnsTillBirth > 0 )
+        {
+            if( state->rockfordTurnsTillBirth % 2 )
+            {
+                visual = cellVisual( spriteSteelWall, 0, colors->boulderFg, BLACK, 0 );
+            }
+            else
             {
-                uint8_t *data = sprite + 2
-                        + (frame % frames) * bytesPerFrame+ row*bytesPerRow + col*TILE_SIZE;
-                drawTile( data, x, y, fgColor, bgColor, vOffset );
+                visual = cellVisual( spriteOutbox, 0, colors->boulderFg, BLACK, 0 );
             }
         }
+        else
+        {
+            visual = cellVisual( spriteExplosion, 0, WHITE, BLACK, 0 );
+        }
+        break;
+    case OBJ_PRE_ROCKFORD_2:
+        visual = cellVisual( spriteExplosion, 1, WHITE, BLACK, 0 );
+        break;
+    case OBJ_PRE_ROCKFORD_3:
+        visual = cellVisual( spriteExplosion, 2, WHITE, BLACK, 0 );
+        break;
+    case OBJ_PRE_ROCKFORD_4:
+        visual = cellVisual( spriteRockfordRight, state->turn, GRAY, BLACK, 0 );
+        break;
+
+        //
+        // Draw rockford
+        //
+
+    case OBJ_ROCKFORD:
+        if( state->rockfordIsMoving )
+        {
+            if( state->rockfordIsFacingRight )
+            {
+                visual = cellVisual( spriteRockfordRight, state->tick, GRAY, BLACK, 0 );
+            }
+            else
+            {
+                visual = cellVisual( spriteRockfordLeft, state->tick, GRAY, BLACK, 0 );
+            }
+        }
+        else if( state->rockfordIsBlinking && state->rockfordIsTapping )
+        {
+            visual = cellVisual( spriteRockfordBlinkTap, state->tick, GRAY, BLACK, 0 );
+        }
+        else if( state->rockfordIsBlinking )
+        {
+            visual = cellVisual( spriteRockfordBlink, state->tick, GRAY, BLACK, 0 );
+        }
+        else if( state->rockfordIsTapping )
+        {
+            visual = cellVisual( spriteRockfordTap, state->tick, GRAY, BLACK, 0 );
+        }
+        else
+        {
+            visual = cellVisual( spriteRockfordIdle, 0, GRAY, BLACK, 0 );
+        }
+        break;
+
+        //
+        // Draw explosion
+        //
+
+    case OBJ_EXPLODE_TO_SPACE_1:
+    case OBJ_EXPLODE_TO_DIAMOND_1:
+        visual = cellVisual( spriteExplosion, 1, WHITE, BLACK, 0 );
+        break;
+    case OBJ_EXPLODE_TO_SPACE_2:
+    case OBJ_EXPLODE_TO_DIAMOND_2:
+        visual = cellVisual( spriteExplosion, 2, WHITE, BLACK, 0 );
+        break;
+    case OBJ_EXPLODE_TO_SPACE_3:
+    case OBJ_EXPLODE_TO_DIAMOND_3:
+        visual = cellVisual( spriteExplosion, 1, WHITE, BLACK, 0 );
+        break;
+    case OBJ_EXPLODE_TO_SPACE_4:
+    case OBJ_EXPLODE_TO_DIAMOND_4:
+        visual = cellVisual( spriteExplosion, 0, WHITE, BLACK, 0 );
+        break;
+
+    case OBJ_AMOEBA:
+        visual = cellVisual( spriteAmoeba, state->turn, GREEN, BLACK, 0 );
+        break;
+    }
+
+    return visual;
+}
+
+CellVisual getCellVisual(const GameState *state, const CaveColors *colors, int row, int col)
+{
+    if( isCellCovered( state, row, col ) )
+    {
+        return cellVisual( spriteSteelWall, 0, colors->boulderFg, BLACK, state->turn );
     }
+
+    return getObjectVisual( state, colors, state->map[CELL_INDEX( state, row, col )] );
 }
 
 //
-// Cave decoding
+// Cave layer
+//
+// The whole cave is drawn into an off-screen layer, one cell at a time and
+// only when a cell's visual changes. Each frame copies the playfield
+// window at the camera position out of the layer, or just the changed
+// cells when the camera has not moved. The border is only filled again
+// when its colour changes.
 //
 
-void nextRandom(int *randSeed1, int *randSeed2)
+// Cells the playfield can show part of, with a margin of one all round
+#define MAX_VISIBLE_CELLS ((PLAYFIELD_HEIGHT / CELL_SIZE + 3) * (PLAYFIELD_WIDTH / CELL_SIZE + 3))
+
+// Sized for the cave being drawn, and reallocated when a cave of another size is loaded
+uint8_t *caveLayer;         // caveLayerWidth pixels per row
+int caveLayerWidth;
+CellVisual *layerCells;     // layerCols cells per row
+int layerCols;
+int layerRows;
+bool isLayerDrawn;
+
+bool isScreenDrawn;
+Color drawnBorderColor;
+int drawnCameraX;
+int drawnCameraY;
+int drawnCaveWidth;
+int drawnCaveHeight;
+bool wasPlayfieldOverdrawn;     // Tile cover or falling objects were drawn over the cave layer
+
+// Draws a cell into the layer from its cached pixels, or expands it on the spot when they are NULL
+void drawLayerCell(const CellVisual *visual, const uint8_t *pixels, int row, int col)
 {
-    int tempRand1 = (*randSeed1 & 0x0001) * 0x0080;
-    int tempRand2 = (*randSeed2 >> 1) & 0x007F;
+    uint8_t *dst = &caveLayer[ row * CELL_SIZE * caveLayerWidth + col * CELL_SIZE ];
+
+    if( !visual->sprite )
+    {
+        for( int y = 0; y < CELL_SIZE; ++y )
+        {
+            memset( dst + y * caveLayerWidth, visual->fgColor, CELL_SIZE );
+        }
+        return;
+    }
 
-    int result = (*randSeed2) + (*randSeed2 & 0x0001) * 0x0080;
-    int carry = (result > 0x00FF);
-    result = result & 0x00FF;
+    assert( visual->sprite[ 1 ] * TILE_SIZE == CELL_SIZE );
 
-    result = result + carry + 0x13;
-    carry = (result > 0x00FF);
-    *randSeed2 = result & 0x00FF;
+    if( pixels )
+    {
+        for( int y = 0; y < CELL_SIZE; ++y )
+        {
+            memcpy( dst + y * caveLayerWidth, pixels + y * CELL_SIZE, CELL_SIZE );
+        }
+    }
+    else
+    {
+        expandSprite( visual->sprite, visual->frame, visual->fgColor, visual->bgColor, visual->vOffset, dst,
+                caveLayerWidth );
+    }
+}
 
-    result = *randSeed1 + carry + tempRand1;
-    carry = (result > 0x00FF);
-    result = result & 0x00FF;
+// Makes the layer fit the state's cave, to be drawn again from scratch if it did not
+void sizeCaveLayer(const GameState *state)
+{
+    if( state->caveWidth == layerCols && state->caveHeight == layerRows )
+    {
+        return;
+    }
 
-    result = result + carry + tempRand2;
-    *randSeed1 = result & 0x00FF;
+    free( caveLayer );
+    free( layerCells );
+    layerCols = state->caveWidth;
+    layerRows = state->caveHeight;
+    caveLayerWidth = layerCols * CELL_SIZE;
+    caveLayer = malloc( (size_t) caveLayerWidth * layerRows * CELL_SIZE );
+    layerCells = malloc( (size_t) layerCols * layerRows * sizeof(*layerCells) );
+    assert( caveLayer && layerCells );
+    isLayerDrawn = false;
 }
 
-void placeObjectLine(Object object, int row, int col, int length, int direction)
+// Copies the part of a backbuffer rectangle that lies on the playfield
+// and inside the cave from the cave layer
+void blitCaveLayer(const GameState *state, int cameraX, int cameraY, int left, int top, int right, int bottom)
 {
-    int ldx[ 8 ] = { 0, 1, 1, 1, 0, -1, -1, -1 };
-    int ldy[ 8 ] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+    int caveLeft = PLAYFIELD_LEFT - cameraX;
+    int caveTop = PLAYFIELD_TOP - cameraY;
+    int caveRight = caveLeft + state->caveWidth * CELL_SIZE - 1;
+    int caveBottom = caveTop + state->caveHeight * CELL_SIZE - 1;
+
+    left = left > PLAYFIELD_LEFT ? left : PLAYFIELD_LEFT;
+    left = left > caveLeft ? left : caveLeft;
+    top = top > PLAYFIELD_TOP ? top : PLAYFIELD_TOP;
+    top = top > caveTop ? top : caveTop;
+    right = right < PLAYFIELD_RIGHT ? right : PLAYFIELD_RIGHT;
+    right = right < caveRight ? right : caveRight;
+    bottom = bottom < PLAYFIELD_BOTTOM ? bottom : PLAYFIELD_BOTTOM;
+    bottom = bottom < caveBottom ? bottom : caveBottom;
+
+    if( left > right )
+    {
+        return;
+    }
 
-    for( int i = 0; i < length; i++ )
+    for( int y = top; y <= bottom; ++y )
     {
-        map[row + i * ldy[direction]][col + i * ldx[direction]] = object;
+        memcpy( (void*) &backbuffer[ y * BACKBUFFER_WIDTH + left ],
+                &caveLayer[ (y - caveTop) * caveLayerWidth + left - caveLeft ], right - left + 1 );
     }
 }
 
-void placeObjectFilledRect(Object object, int row, int col, int width, int height, Object fillObject)
+//
+// Playfield bands
+//
+// The cave part of a frame is split into horizontal bands of cave rows,
+// rasterised side by side on a pool of render threads. Everything shared
+// is worked out up front on the calling thread: which layer cells changed
+// and where their cached pixels are, since filling the sprite cache is
+// not thread safe. Each band then draws its own layer cells and copies
+// its own playfield rows, so no two bands ever write the same pixel.
+//
+
+#define RENDER_MAX_BANDS 8
+#define RENDER_MIN_BAND_CELLS 32    // Fewer changed cells than this are not worth waking the pool for
+
+typedef struct
+{
+    CellVisual visual;
+    const uint8_t *pixels;  // Cached pixels, NULL to expand on the spot
+    int row;
+    int col;
+} LayerCellUpdate;
+
+// Read only while the bands run
+typedef struct
+{
+    const GameState *state;
+    int cameraX;
+    int cameraY;
+    bool isCopyingPlayfield;
+    const LayerCellUpdate *updates;     // In row order
+    int bandCount;
+    int bandFirstRow[ RENDER_MAX_BANDS + 1 ];
+    int bandFirstUpdate[ RENDER_MAX_BANDS + 1 ];
+} PlayfieldJob;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    const PlayfieldJob *job;
+    int frame;          // Counts the jobs handed out
+    int bandsLeft;
+    int threadCount;
+    int bandLimit;      // Most bands a frame is split into, at most threadCount + 1
+    int minBandCells;   // Frames with fewer changed cells that copy no playfield are not split
+    pthread_t threads[ RENDER_MAX_BANDS - 1 ];
+} RenderPool;
+
+RenderPool renderPool;
+
+void renderBand(const PlayfieldJob *job, int band)
 {
-    for( int x = 0; x < width; x++ )
+    const GameState *state = job->state;
+
+    for( int i = job->bandFirstUpdate[ band ]; i < job->bandFirstUpdate[ band + 1 ]; ++i )
     {
-        for( int y = 0; y < height; y++ )
+        const LayerCellUpdate *update = &job->updates[ i ];
+        drawLayerCell( &update->visual, update->pixels, update->row, update->col );
+
+        if( !job->isCopyingPlayfield )
         {
-            if( y == 0 || y == height - 1 || x == 0 || x == width - 1 )
-            {
-                map[row + y][col + x] = object;
-            }
-            else
-            {
-                map[row + y][col + x] = fillObject;
-            }
+            int x = PLAYFIELD_LEFT + update->col * CELL_SIZE - job->cameraX;
+            int y = PLAYFIELD_TOP + update->row * CELL_SIZE - job->cameraY;
+            blitCaveLayer( state, job->cameraX, job->cameraY, x, y, x + CELL_SIZE - 1, y + CELL_SIZE - 1 );
         }
     }
+
+    if( job->isCopyingPlayfield )
+    {
+        // The outer bands also take the playfield rows beyond the cave rows they cover
+        int top = band == 0 ? PLAYFIELD_TOP
+                : PLAYFIELD_TOP + job->bandFirstRow[ band ] * CELL_SIZE - job->cameraY;
+        int bottom = band == job->bandCount - 1 ? PLAYFIELD_BOTTOM
+                : PLAYFIELD_TOP + job->bandFirstRow[ band + 1 ] * CELL_SIZE - job->cameraY - 1;
+        blitCaveLayer( state, job->cameraX, job->cameraY, PLAYFIELD_LEFT, top, PLAYFIELD_RIGHT, bottom );
+    }
 }
 
-void placeObjectRect(Object object, int row, int col, int width, int height)
+void *renderThreadMain(void *arg)
 {
-    for( int i = 0; i < width; i++ )
+    int band = (int) (intptr_t) arg;
+    int frame = 0;
+
+    pthread_mutex_lock( &renderPool.lock );
+    for( ;; )
     {
-        map[row][col + i] = object;
-        map[row + height - 1][col + i] = object;
+        while( renderPool.frame == frame )
+        {
+            pthread_cond_wait( &renderPool.start, &renderPool.lock );
+        }
+        frame = renderPool.frame;
+        const PlayfieldJob *job = renderPool.job;
+        pthread_mutex_unlock( &renderPool.lock );
+
+        if( band < job->bandCount )
+        {
+            renderBand( job, band );
+        }
+
+        pthread_mutex_lock( &renderPool.lock );
+        if( --renderPool.bandsLeft == 0 )
+        {
+            pthread_cond_signal( &renderPool.done );
+        }
     }
-    for( int i = 0; i < height; i++ )
+
+    return NULL;
+}
+
+// Lets renderGame split the playfield into up to bandCount bands, one per thread
+void startRenderThreads(int bandCount)
+{
+    bandCount = bandCount < RENDER_MAX_BANDS ? bandCount : RENDER_MAX_BANDS;
+
+    pthread_mutex_init( &renderPool.lock, NULL );
+    pthread_cond_init( &renderPool.start, NULL );
+    pthread_cond_init( &renderPool.done, NULL );
+
+    // The calling thread renders the first band itself
+    for( int i = 0; i < bandCount - 1; ++i )
     {
-        map[row + i][col] = object;
-        map[row + i][col + width - 1] = object;
+        int rslt = pthread_create( &renderPool.threads[i], NULL, renderThreadMain,
+                (void*) (intptr_t) (i + 1) );
+        assert( 0 == rslt );
+        ++renderPool.threadCount;
     }
+    renderPool.bandLimit = renderPool.threadCount + 1;
+    renderPool.minBandCells = RENDER_MIN_BAND_CELLS;
 }
 
-void decodeCave(int caveIndex)
+// Caps the bands a frame is split into, down to one for the single threaded renderer
+void setRenderBandLimit(int bandLimit)
 {
-    uint8_t *caves[CAVE_COUNT] = { caveA, caveB, caveC, caveD, intermission1, caveE, caveF, caveG, caveH,
-            intermission2, caveI, caveJ, caveK, caveL, intermission3, caveM, caveN, caveO, caveP,
-            intermission4, };
+    bandLimit = bandLimit < renderPool.threadCount + 1 ? bandLimit : renderPool.threadCount + 1;
+    renderPool.bandLimit = bandLimit > 1 ? bandLimit : 1;
+}
 
-    assert( caveIndex >= 0 && caveIndex < CAVE_COUNT );
+// Splits the rows from firstRow to lastRow into bands as evenly as the pool allows and renders them
+void renderPlayfield(PlayfieldJob *job, int updateCount, int firstRow, int lastRow)
+{
+    int rows = lastRow - firstRow + 1;
+    bool isWorthSplitting = job->isCopyingPlayfield || updateCount >= renderPool.minBandCells;
 
-    caveInfo = (CaveInfo*) caves[caveIndex];
+    job->bandCount = isWorthSplitting && renderPool.bandLimit > 1 ? renderPool.bandLimit : 1;
+    job->bandCount = job->bandCount < rows ? job->bandCount : (rows > 0 ? rows : 1);
 
-    // Clear out the map
-    for( int row = 0; row < CAVE_HEIGHT; row++ )
+    // Updates come in row order, so each band's are a contiguous run
+    int update = 0;
+    for( int band = 0; band <= job->bandCount; ++band )
     {
-        for( int col = 0; col < CAVE_WIDTH; col++ )
+        int row = firstRow + rows * band / job->bandCount;
+        while( band > 0 && update < updateCount && job->updates[ update ].row < row )
         {
-            map[row][col] = OBJ_STEEL_WALL;
+            ++update;
         }
+        job->bandFirstRow[ band ] = row;
+        job->bandFirstUpdate[ band ] = band == job->bandCount ? updateCount : update;
     }
 
-    // Decode random map objects
+    if( job->bandCount == 1 )
     {
-        int randSeed1 = 0;
-        int randSeed2 = caveInfo->randomiserSeed[0];
+        renderBand( job, 0 );
+        return;
+    }
+
+    pthread_mutex_lock( &renderPool.lock );
+    renderPool.job = job;
+    renderPool.bandsLeft = renderPool.threadCount;
+    ++renderPool.frame;
+    pthread_cond_broadcast( &renderPool.start );
+    pthread_mutex_unlock( &renderPool.lock );
+
+    renderBand( job, 0 );
+
+    pthread_mutex_lock( &renderPool.lock );
+    while( renderPool.bandsLeft > 0 )
+    {
+        pthread_cond_wait( &renderPool.done, &renderPool.lock );
+    }
+    pthread_mutex_unlock( &renderPool.lock );
+}
 
-        for( int row = 1; row < CAVE_HEIGHT; row++ )
+//
+// Interpolation
+//
+// The display runs faster than the turns, so between turns the camera and
+// falling objects are drawn part of the way from where they were when the
+// turn started. turnStart is the state before the last turn boundary,
+// alpha how far the display has got through the turn since.
+//
+
+typedef struct
+{
+    CellVisual visual;
+    int x;  // Cave pixel position
+    int y;
+} FallingObject;
+
+int interpolate(int from, int to, float alpha)
+{
+    return from + (int) ((to - from) * alpha);
+}
+
+bool isBoulderOrDiamond(uint8_t object, bool isBoulder)
+{
+    return isBoulder ? (object == OBJ_BOULDER_STATIONARY || object == OBJ_BOULDER_FALLING)
+            : (object == OBJ_DIAMOND_STATIONARY || object == OBJ_DIAMOND_FALLING);
+}
+
+// Finds the cell a falling object moved from during the turn: the cell above, the cell it rolled off
+// sideways, or the cell above a magic wall it passed through
+bool findFallSource(const GameState *turnStart, const GameState *state, int row, int col, int *sourceCell)
+{
+    int cell = CELL_INDEX( state, row, col );
+    int stride = state->caveStride;
+    const uint8_t *before = turnStart->map;
+    bool isBoulder = state->map[cell] == OBJ_BOULDER_FALLING;
+
+    if( isBoulderOrDiamond( before[cell - stride], isBoulder ) )
+    {
+        *sourceCell = cell - stride;
+    }
+    else if( before[cell] == OBJ_SPACE && isBoulderOrDiamond( before[cell + 1], isBoulder ) )
+    {
+        *sourceCell = cell + 1;
+    }
+    else if( before[cell] == OBJ_SPACE && isBoulderOrDiamond( before[cell - 1], isBoulder ) )
+    {
+        *sourceCell = cell - 1;
+    }
+    else if( row >= 2 && before[cell - stride] == OBJ_MAGIC_WALL
+            && isBoulderOrDiamond( before[cell - 2 * stride], !isBoulder ) )
+    {
+        *sourceCell = cell - 2 * stride;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Draws the state, with the camera and falling objects alpha of the way through the turn that
+// started at turnStart. A NULL turnStart draws the state as it is. Returns true when something
+// was drawn part of the way, so the frame would change with alpha.
+bool renderGame(const GameState *state, const GameState *turnStart, float alpha, const CaveColors *colors)
+{
+    // Room for every value at full int width; only the first PLAYFIELD_WIDTH_IN_TILES characters are drawn
+    char statusBarText[80];
+
+    //
+    // Update status bar
+    //
+
+    if( state->livesLeft == 0 )
+    {
+        snprintf( statusBarText, sizeof(statusBarText), "        G A M E  O V E R" );
+    }
+    else if( state->isOutOfTimeTextShown && state->tileCoverTicksLeft == 0 )
+    {
+        snprintf( statusBarText, sizeof(statusBarText), "     O U T   O F   T I M E" );
+    }
+    else
+    {
+        if( state->rockfordTurnsTillBirth > 0 || state->tileCoverTicksLeft > 0 || state->isCaveStart )
         {
-            for( int col = 0; col < CAVE_WIDTH; col++ )
+            if( isIntermission( state ) )
             {
-                Object object = OBJ_DIRT;
-                nextRandom( &randSeed1, &randSeed2 );
-                for( int i = 0; i < NUM_RANDOM_OBJECTS; i++ )
-                {
-                    if( randSeed1 < caveInfo->objectProbability[i] )
-                    {
-                        object = caveInfo->randomObject[i];
-                    }
-                }
-                map[row][col] = object;
+                snprintf( statusBarText, sizeof(statusBarText), "       B O N U S  L I F E" );
+            }
+            else
+            {
+                snprintf( statusBarText, sizeof(statusBarText), "  PLAYER 1,  %d MEN,  ROOM %c/%d",
+                        state->livesLeft, getCurrentCaveLetter( state ), state->difficultyLevel + 1 );
             }
         }
+        else
+        {
+            if( state->diamondsCollected < state->caveInfo->diamondsNeeded[state->difficultyLevel] )
+            {
+                snprintf( statusBarText, sizeof(statusBarText), "   %02d*%02d   %02d   %03d   %06d",
+                        state->caveInfo->diamondsNeeded[state->difficultyLevel], state->currentDiamondValue,
+                        state->diamondsCollected, state->caveTimeLeft, state->score );
+            }
+            else
+            {
+                snprintf( statusBarText, sizeof(statusBarText), "   ***%02d   %02d   %03d   %06d",
+                        state->currentDiamondValue, state->diamondsCollected, state->caveTimeLeft,
+                        state->score );
+            }
+        }
+    }
+
+    //
+    // Render
+    //
+
+    bool isInterpolating = turnStart && alpha < 1.0f && turnStart->turn + 1 == state->turn
+            && turnStart->loadedCaveNumber == state->loadedCaveNumber
+            && turnStart->caveStride == state->caveStride && turnStart->caveHeight == state->caveHeight;
+
+    int cameraX = state->cameraX;
+    int cameraY = state->cameraY;
+
+    // Cave changes jump the camera, they are not scrolled
+    if( isInterpolating && abs( state->cameraX - turnStart->cameraX ) <= CAMERA_STEP
+            && abs( state->cameraY - turnStart->cameraY ) <= CAMERA_STEP )
+    {
+        cameraX = interpolate( turnStart->cameraX, state->cameraX, alpha );
+        cameraY = interpolate( turnStart->cameraY, state->cameraY, alpha );
+    }
+
+    // Draw border
+    bool isRedrawingBorder = !isScreenDrawn || state->borderColor != drawnBorderColor || DEV_CAMERA_DEBUGGING;
+    if( isRedrawingBorder )
+    {
+        drawFilledRect( 0, 0, BACKBUFFER_WIDTH - 1, BACKBUFFER_HEIGHT - 1, state->borderColor );
     }
 
-    // Steel bounds
-    placeObjectRect( OBJ_STEEL_WALL, 0, 0, CAVE_WIDTH, CAVE_HEIGHT );
+    // Update the cave layer, copying changed cells straight to the backbuffer unless the whole
+    // playfield is copied
+    bool isCopyingPlayfield = isRedrawingBorder || wasPlayfieldOverdrawn || cameraX != drawnCameraX
+            || cameraY != drawnCameraY || state->caveWidth != drawnCaveWidth
+            || state->caveHeight != drawnCaveHeight;
 
-    // Decode explicit map data
+    sizeCaveLayer( state );
+    if( !isLayerDrawn )
     {
-        uint8_t *explicitData = caves[caveIndex] + sizeof(CaveInfo);
-        int uselessTopBorderHeight = 2;
+        // No real visual matches an empty layer cell
+        for( int i = 0; i < layerCols * layerRows; ++i )
+        {
+            layerCells[ i ] = (CellVisual) { .fgColor = COLOR_COUNT };
+        }
+        isLayerDrawn = true;
+    }
 
-        for( int i = 0; explicitData[i] != 0xFF; i++ )
+    // Only the cells on the playfield are brought up to date, the rest of the layer catches up when
+    // the camera reaches them. While interpolating, one more cell all round catches objects falling
+    // onto the playfield or off it.
+    int margin = isInterpolating ? 1 : 0;
+    int firstRow = (cameraY > 0 ? cameraY / CELL_SIZE : 0) - margin;
+    int firstCol = (cameraX > 0 ? cameraX / CELL_SIZE : 0) - margin;
+    int lastRow = (cameraY + PLAYFIELD_HEIGHT - 1) / CELL_SIZE + margin;
+    int lastCol = (cameraX + PLAYFIELD_WIDTH - 1) / CELL_SIZE + margin;
+    firstRow = firstRow > 0 ? firstRow : 0;
+    firstCol = firstCol > 0 ? firstCol : 0;
+    lastRow = lastRow < state->caveHeight - 1 ? lastRow : state->caveHeight - 1;
+    lastCol = lastCol < state->caveWidth - 1 ? lastCol : state->caveWidth - 1;
+
+    FallingObject fallingObjects[ MAX_VISIBLE_CELLS ];
+    int fallingObjectCount = 0;
+    LayerCellUpdate updates[ MAX_VISIBLE_CELLS ];
+    int updateCount = 0;
+
+    for( int row = firstRow; row <= lastRow; ++row )
+    {
+        for( int col = firstCol; col <= lastCol; ++col )
         {
-            Object object = (explicitData[i] & 0x3F);
+            uint8_t object = state->map[ CELL_INDEX( state, row, col ) ];
+            int sourceCell;
+            CellVisual visual;
 
-            switch( 3 & (explicitData[i] >> 6) )
-            {
-            case OBJST_SINGLE:
+            if( isInterpolating && (object == OBJ_BOULDER_FALLING || object == OBJ_DIAMOND_FALLING)
+                    && !isCellCovered( state, row, col )
+                    && findFallSource( turnStart, state, row, col, &sourceCell ) )
             {
-                int col = explicitData[++i];
-                int row = explicitData[++i] - uselessTopBorderHeight;
-                map[row][col] = object;
-                break;
+                // The layer shows the space it is falling into, the object itself is drawn on top
+                assert( fallingObjectCount < MAX_VISIBLE_CELLS );
+                fallingObjects[ fallingObjectCount++ ] = (FallingObject) {
+                    getObjectVisual( state, colors, object ),
+                    interpolate( CELL_COL( state, sourceCell ) * CELL_SIZE, col * CELL_SIZE, alpha ),
+                    interpolate( CELL_ROW( state, sourceCell ) * CELL_SIZE, row * CELL_SIZE, alpha ) };
+                visual = getObjectVisual( state, colors, OBJ_SPACE );
             }
-            case OBJST_LINE:
+            else
             {
-                int col = explicitData[++i];
-                int row = explicitData[++i] - uselessTopBorderHeight;
-                int length = explicitData[++i];
-                int direction = explicitData[++i];
-                placeObjectLine( object, row, col, length, direction );
-                break;
+                visual = getCellVisual( state, colors, row, col );
             }
-            case OBJST_FILLED_RECT:
+
+            CellVisual *drawn = &layerCells[ row * layerCols + col ];
+
+            if( !isSameCellVisual( &visual, drawn ) )
             {
-                int col = explicitData[++i];
-                int row = explicitData[++i] - uselessTopBorderHeight;
-                int width = explicitData[++i];
-                int height = explicitData[++i];
-                Object fill = explicitData[++i];
-                placeObjectFilledRect( object, row, col, width, height, fill );
-                break;
+                const uint8_t *pixels = visual.sprite && visual.vOffset == 0 ? getCachedSprite(
+                        visual.sprite, visual.frame, visual.fgColor, visual.bgColor ) : NULL;
+                updates[ updateCount++ ] = (LayerCellUpdate) { visual, pixels, row, col };
+                *drawn = visual;
             }
-            case OBJST_RECT:
+        }
+    }
+
+    if( isCopyingPlayfield )
+    {
+        // A cave smaller than the playfield leaves some of it to the border
+        int caveLeft = PLAYFIELD_LEFT - cameraX;
+        int caveTop = PLAYFIELD_TOP - cameraY;
+        if( !isRedrawingBorder && (caveLeft > PLAYFIELD_LEFT || caveTop > PLAYFIELD_TOP
+                || caveLeft + state->caveWidth * CELL_SIZE <= PLAYFIELD_RIGHT
+                || caveTop + state->caveHeight * CELL_SIZE <= PLAYFIELD_BOTTOM) )
+        {
+            drawFilledRect( PLAYFIELD_LEFT, PLAYFIELD_TOP, PLAYFIELD_RIGHT, PLAYFIELD_BOTTOM,
+                    state->borderColor );
+        }
+    }
+
+    PlayfieldJob job = {
+        .state = state,
+        .cameraX = cameraX,
+        .cameraY = cameraY,
+        .isCopyingPlayfield = isCopyingPlayfield,
+        .updates = updates,
+    };
+    renderPlayfield( &job, updateCount, firstRow, lastRow );
+
+    isScreenDrawn = true;
+    drawnBorderColor = state->borderColor;
+    drawnCameraX = cameraX;
+    drawnCameraY = cameraY;
+    drawnCaveWidth = state->caveWidth;
+    drawnCaveHeight = state->caveHeight;
+
+    wasPlayfieldOverdrawn = fallingObjectCount > 0;
+
+    for( int i = 0; i < fallingObjectCount; ++i )
+    {
+        const FallingObject *falling = &fallingObjects[ i ];
+        drawSprite( falling->visual.sprite, falling->visual.frame, PLAYFIELD_LEFT + falling->x - cameraX,
+                PLAYFIELD_TOP + falling->y - cameraY, falling->visual.fgColor, falling->visual.bgColor, 0 );
+    }
+
+    //
+    // Draw tile cover
+    //
+
+    for( int row = 0; row < PLAYFIELD_HEIGHT_IN_TILES; ++row )
+    {
+        for( int col = 0; col < PLAYFIELD_WIDTH_IN_TILES; ++col )
+        {
+            if( isTileCovered( state, row, col ) )
             {
-                int col = explicitData[++i];
-                int row = explicitData[++i] - uselessTopBorderHeight;
-                int width = explicitData[++i];
-                int height = explicitData[++i];
-                placeObjectRect( object, row, col, width, height );
-                break;
-            }
+                int x = PLAYFIELD_LEFT + col * TILE_SIZE;
+                int y = PLAYFIELD_TOP + row * TILE_SIZE;
+                drawSprite( spriteSteelWallTile, 0, x, y, colors->boulderFg, BLACK, state->turn );
+                wasPlayfieldOverdrawn = true;
             }
         }
     }
+
+    //
+    // Draw status bar
+    //
+
+    {
+        // Black background
+        drawFilledRect( VIEWPORT_LEFT, VIEWPORT_TOP, VIEWPORT_RIGHT, VIEWPORT_TOP + STATUS_BAR_HEIGHT,
+                BLACK );
+
+        int x = VIEWPORT_LEFT;
+        int y = VIEWPORT_TOP + TILE_SIZE;
+
+        for( int i = 0; statusBarText[i] && i < PLAYFIELD_WIDTH_IN_TILES; ++i )
+        {
+            drawSprite( spriteAscii, statusBarText[i] - ' ', x + i * TILE_SIZE, y, GRAY, BLACK, 0 );
+        }
+    }
+
+    //
+    // Camera debugging
+    //
+
+    if( DEV_CAMERA_DEBUGGING )
+    {
+        drawRect( CAMERA_START_LEFT, 0, CAMERA_START_LEFT, BACKBUFFER_HEIGHT - 1, WHITE );
+        drawRect( CAMERA_STOP_LEFT, 0, CAMERA_STOP_LEFT, BACKBUFFER_HEIGHT - 1, WHITE );
+        drawRect( CAMERA_START_RIGHT, 0, CAMERA_START_RIGHT, BACKBUFFER_HEIGHT - 1, WHITE );
+        drawRect( CAMERA_STOP_RIGHT, 0, CAMERA_STOP_RIGHT, BACKBUFFER_HEIGHT - 1, WHITE );
+
+        drawRect( 0, CAMERA_START_TOP, BACKBUFFER_WIDTH - 1, CAMERA_START_TOP, WHITE );
+        drawRect( 0, CAMERA_STOP_TOP, BACKBUFFER_WIDTH - 1, CAMERA_STOP_TOP, WHITE );
+        drawRect( 0, CAMERA_START_BOTTOM, BACKBUFFER_WIDTH - 1, CAMERA_START_BOTTOM, WHITE );
+        drawRect( 0, CAMERA_STOP_BOTTOM, BACKBUFFER_WIDTH - 1, CAMERA_STOP_BOTTOM, WHITE );
+
+        int rockfordRectLeft = PLAYFIELD_LEFT + state->rockfordCol * CELL_SIZE - cameraX;
+        int rockfordRectTop = PLAYFIELD_TOP + state->rockfordRow * CELL_SIZE - cameraY;
+        drawRect( rockfordRectLeft, rockfordRectTop, rockfordRectLeft + CELL_SIZE, rockfordRectTop + CELL_SIZE,
+                WHITE );
+    }
+
+    return cameraX != state->cameraX || cameraY != state->cameraY || fallingObjectCount > 0;
 }
 
 //
-// Gameplay
+// Render hashing
+//
+// Replays are drawn headless and every frame is hashed, once with the
+// playfield on a single band and once split over the render pool. The
+// two hashes only match if the bands draw exactly what the single
+// threaded renderer does.
 //
 
-bool isObjectRound(Object object)
-{
-    return object == OBJ_BOULDER_STATIONARY || object == OBJ_DIAMOND_STATIONARY || object == OBJ_BRICK_WALL;
-}
+#define RENDER_HASH_FRAMES_PER_TICK 2   // Drawn part of the way through each tick, as the display does
 
-bool isObjectExplosive(Object object)
+// FNV-1a a word at a time, over four interleaved lanes so the multiplies overlap
+uint64_t hashBackbuffer(uint64_t hash)
 {
-    return object == OBJ_ROCKFORD || object == OBJ_FIREFLY_LEFT || object == OBJ_FIREFLY_UP
-            || object == OBJ_FIREFLY_RIGHT || object == OBJ_FIREFLY_DOWN || object == OBJ_BUTTERFLY_DOWN
-            || object == OBJ_BUTTERFLY_LEFT || object == OBJ_BUTTERFLY_UP || object == OBJ_BUTTERFLY_RIGHT;
-}
+    _Static_assert( BACKBUFFER_BYTES % 32 == 0, "backbuffer is hashed 32 bytes at a time" );
+    uint64_t lanes[4] = { hash, hash + 1, hash + 2, hash + 3 };
 
-bool explodesToDiamonds(Object object)
-{
-    assert( isObjectExplosive( object ) );
-    return object == OBJ_BUTTERFLY_DOWN || object == OBJ_BUTTERFLY_LEFT || object == OBJ_BUTTERFLY_UP
-            || object == OBJ_BUTTERFLY_RIGHT;
+    for( int i = 0; i < BACKBUFFER_BYTES; i += 32 )
+    {
+        for( int lane = 0; lane < 4; ++lane )
+        {
+            uint64_t word;
+            memcpy( &word, (const uint8_t*) backbuffer + i + lane * 8, sizeof(word) );
+            lanes[ lane ] = (lanes[ lane ] ^ word) * 0x100000001B3ULL;
+        }
+    }
+    return ((lanes[0] * 31 + lanes[1]) * 31 + lanes[2]) * 31 + lanes[3];
 }
 
-void explodeCell(int row, int col, bool toDiamonds, int stage)
+// Plays the replay, drawing every tick RENDER_HASH_FRAMES_PER_TICK times, and returns the hash of
+// all the frames. Counts the frames and the ones the render pool split into bands.
+uint64_t hashReplayFrames(const Replay *replay, const CaveColors caveColors[], int *frames, int *splitFrames)
 {
-    if( map[row][col] != OBJ_STEEL_WALL )
+    static GameState state, tickStartState, turnStartState;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    int poolFrame = renderPool.frame;
+
+    startReplay( replay, &state );
+    cloneGameState( &turnStartState, &state );
+
+    // Every pass starts from a blank screen and layer, like a new game
+    isScreenDrawn = false;
+    isLayerDrawn = false;
+    *frames = 0;
+
+    for( uint32_t i = 0; i < replay->runCount; ++i )
     {
-        if( toDiamonds )
+        Input input = replay->runs[i].input;
+        for( int tick = 0; tick <= replay->runs[i].lengthMinusOne; ++tick )
         {
-            map[row][col] = stage == 0 ? OBJ_EXPLODE_TO_DIAMOND_0 : OBJ_EXPLODE_TO_DIAMOND_1;
+            cloneGameState( &tickStartState, &state );
+            stepGame( &state, input );
+            if( state.tick % TICKS_PER_TURN == 0 )
+            {
+                cloneGameState( &turnStartState, &tickStartState );
+            }
+
+            for( int frame = 0; frame < RENDER_HASH_FRAMES_PER_TICK; ++frame )
+            {
+                float tickFraction = (float) frame / RENDER_HASH_FRAMES_PER_TICK;
+                float alpha = ((state.tick % TICKS_PER_TURN) + tickFraction) / TICKS_PER_TURN;
+                renderGame( &state, &turnStartState, alpha, &caveColors[ state.loadedCaveNumber ] );
+                hash = hashBackbuffer( hash );
+                ++*frames;
+            }
         }
-        else
+    }
+
+    *splitFrames = renderPool.frame - poolFrame;
+    return hash;
+}
+
+// Checks every replay draws the same frames on one band as on up to bandCount
+int verifyRenderHashes(int count, char *paths[], int bandCount, const CaveColors caveColors[])
+{
+    int failures = 0;
+
+    startRenderThreads( bandCount );
+    bandCount = renderPool.threadCount + 1;
+
+    // Every frame is split, however little changed, so every frame compares the two ways
+    renderPool.minBandCells = 0;
+
+    for( int i = 0; i < count; ++i )
+    {
+        Replay replay;
+        if( !loadReplay( &replay, paths[i] ) )
         {
-            map[row][col] = stage == 0 ? OBJ_EXPLODE_TO_SPACE_0 : OBJ_EXPLODE_TO_SPACE_1;
+            printf( "%s: could not load\n", paths[i] );
+            ++failures;
+            continue;
         }
+
+        int frames, splitFrames;
+        setRenderBandLimit( 1 );
+        uint64_t singleHash = hashReplayFrames( &replay, caveColors, &frames, &splitFrames );
+        setRenderBandLimit( bandCount );
+        uint64_t bandedHash = hashReplayFrames( &replay, caveColors, &frames, &splitFrames );
+
+        bool matches = singleHash == bandedHash;
+        printf( "%s: %s, %d frames, %d split into %d bands, hash %016llx\n", paths[i],
+                matches ? "OK" : "MISMATCH", frames, splitFrames, bandCount,
+                (unsigned long long) bandedHash );
+
+        failures += !matches;
+        freeReplay( &replay );
     }
+
+    printf( "%d replays, %d failed\n", count, failures );
+
+    return failures ? 1 : 0;
 }
 
-void explode(int atRow, int atCol, int scanRow, int scanCol)
+//
+// Sounds
+//
+// The simulation itself is silent. Each tick's sounds are worked out from
+// what the tick changed and posted to the audio thread, so replays and
+// the headless build are unaffected.
+//
+
+SoundSystem soundSystem;
+
+// Posts one sound for each kind of object that landed this turn. Falling objects are active, so
+// only the cells in the active set before the turn need looking at.
+void postLandingSounds(const GameState *before, const GameState *after, uint64_t tickTime)
 {
-    bool toDiamonds = explodesToDiamonds( map[atRow][atCol] );
+    bool hasBoulderLanded = false;
+    bool hasDiamondLanded = false;
 
-    for( int row = atRow - 1; row <= atRow + 1; ++row )
+    int words = ((before->caveHeight + 2) * before->caveStride + 63) / 64;
+    for( int word = 0; word < words; ++word )
     {
-        for( int col = atCol - 1; col <= atCol + 1; ++col )
+        for( uint64_t pending = before->activeCells[word]; pending; pending &= pending - 1 )
         {
-            int stage = ((row < scanRow) || (row == scanRow && col <= scanCol)) ? 1 : 0;
-            explodeCell( row, col, toDiamonds, stage );
+            int cell = word * 64 + __builtin_ctzll( pending );
+            hasBoulderLanded |= before->map[cell] == OBJ_BOULDER_FALLING
+                    && after->map[cell] == OBJ_BOULDER_STATIONARY;
+            hasDiamondLanded |= before->map[cell] == OBJ_DIAMOND_FALLING
+                    && after->map[cell] == OBJ_DIAMOND_STATIONARY;
         }
     }
+
+    if( hasBoulderLanded )
+    {
+        postSound( &soundSystem, SND_BOULDER, tickTime );
+    }
+    if( hasDiamondLanded )
+    {
+        postSound( &soundSystem, SND_DIAMOND, tickTime );
+    }
 }
 
-void updateBoulderAndDiamond(int row, int col, bool isFalling, bool isBoulder)
+// Sounds are due when the tick that made them was
+void postTickSounds(const GameState *before, const GameState *after, uint64_t tickTime)
 {
-    Object fallingScannedObj = isBoulder ? OBJ_BOULDER_FALLING_SCANNED : OBJ_DIAMOND_FALLING_SCANNED;
-    Object stationaryScannedObj = isBoulder ? OBJ_BOULDER_STATIONARY_SCANNED : OBJ_DIAMOND_STATIONARY_SCANNED;
-    Object fallingScannedObjInvert = isBoulder ? OBJ_DIAMOND_FALLING_SCANNED : OBJ_BOULDER_FALLING_SCANNED;
+    if( after->isAddingTimeToScore && after->caveTimeLeft < before->caveTimeLeft )
+    {
+        postSound( &soundSystem, SND_ADDING_TIME_TO_SCORE, tickTime );
+    }
+    if( after->tileCoverTicksLeft > 0 && after->tileCoverTicksLeft != before->tileCoverTicksLeft )
+    {
+        postSound( &soundSystem, SND_UPDATE_TILE_COVER, tickTime );
+    }
 
-    if( map[row + 1][col] == OBJ_SPACE )
+    // Everything else happens on turns, within one cave
+    if( after->tick % TICKS_PER_TURN != 0 || after->turn == before->turn
+            || after->loadedCaveNumber != before->loadedCaveNumber
+            || after->caveStride != before->caveStride )
     {
-        map[row + 1][col] = fallingScannedObj;
-        map[row][col] = OBJ_SPACE;
-        if( !isFalling )
-        {
-        }
+        return;
     }
-    else if( isFalling && map[row + 1][col] == OBJ_MAGIC_WALL )
+
+    if( after->cellCoverTurnsLeft < before->cellCoverTurnsLeft )
     {
-        if( magicWallStatus == MAGIC_WALL_OFF )
-        {
-            magicWallStatus = MAGIC_WALL_ON;
-        }
-        if( magicWallStatus == MAGIC_WALL_ON && map[row + 2][col] == OBJ_SPACE )
-        {
-            map[row + 2][col] = fallingScannedObjInvert;
-        }
-        map[row][col] = OBJ_SPACE;
+        postSound( &soundSystem, SND_UPDATE_CELL_COVER, tickTime );
     }
-    else if( isObjectRound( map[row + 1][col] ) )
+    if( before->rockfordTurnsTillBirth > 0 && after->rockfordTurnsTillBirth == 0 )
     {
-        // Try to roll off
-        if( map[row][col - 1] == OBJ_SPACE && map[row + 1][col - 1] == OBJ_SPACE )
-        {
-            // Roll left
-            map[row][col - 1] = fallingScannedObj;
-            map[row][col] = OBJ_SPACE;
-        }
-        else if( map[row][col + 1] == OBJ_SPACE && map[row + 1][col + 1] == OBJ_SPACE )
+        postSound( &soundSystem, SND_ROCKFORD_BIRTH, tickTime );
+    }
+
+    if( after->diamondsCollected > before->diamondsCollected )
+    {
+        postSound( &soundSystem, SND_DIAMOND, tickTime );
+    }
+    else if( after->rockfordRow != before->rockfordRow || after->rockfordCol != before->rockfordCol )
+    {
+        uint8_t object = before->map[ CELL_INDEX( after, after->rockfordRow, after->rockfordCol ) ];
+        if( object == OBJ_DIRT )
         {
-            // Roll right
-            map[row][col + 1] = fallingScannedObj;
-            map[row][col] = OBJ_SPACE;
+            postSound( &soundSystem, SND_ROCKFORD_MOVE_DIRT, tickTime );
         }
-        else
+        else if( object == OBJ_SPACE )
         {
-            map[row][col] = stationaryScannedObj;
-            if( isFalling )
-            {
-            }
+            postSound( &soundSystem, SND_ROCKFORD_MOVE_SPACE, tickTime );
         }
     }
-    else if( isFalling && isObjectExplosive( map[row + 1][col] ) )
+
+    postLandingSounds( before, after, tickTime );
+
+    if( after->totalAmoebaFoundLastTurn > 0 )
     {
-        explode( row + 1, col, row, col );
+        postSound( &soundSystem, SND_AMOEBA, tickTime );
     }
-    else
+    if( after->magicWallStatus == MAGIC_WALL_ON )
     {
-        map[row][col] = stationaryScannedObj;
-        if( isFalling )
-        {
-        }
+        postSound( &soundSystem, SND_MAGIC_WALL, tickTime );
     }
 }
 
-bool isFailed( void )
+void stopSound(void)
 {
-    return turnsSinceRockfordSeenAlive >= 16 || isOutOfTime;
+    closeSoundSystem( &soundSystem );
 }
 
-bool checkFlyExplode(Object object)
-{
-    return object == OBJ_ROCKFORD || object == OBJ_ROCKFORD_SCANNED || object == OBJ_AMOEBA;
-}
+//
+// Simulation thread
+//
+// The game steps on its own thread so a slow present never delays a tick.
+// After every tick it publishes a copy of the state through a triple buffer:
+// the simulation fills the back frame and swaps it with the spare one, the
+// main thread swaps the spare frame for its front one whenever it is newer.
+// Neither side ever waits for the other, and the front frame stays
+// untouched while it is being drawn. Most ticks between turns change
+// nothing on screen, so the main thread is only woken for frames that look
+// different from the one before.
+//
 
-void getNewFlyPosition(int curRow, int curCol, Direction curDirection, Turning turning, int *newRow,
-        int *newCol, Direction *newDirection)
+typedef struct
 {
-    *newRow = curRow;
-    *newCol = curCol;
+    GameState state;
+    GameState turnStartState;   // For render interpolation
+    uint64_t tickTime;          // When the tick was due
+    uint64_t moveInputTime;     // When the input behind Rockford's latest move or snap was taken
+    uint64_t moveTickTime;      // When the tick that acted on it was due
+    uint32_t viewVersion;       // Changes whenever the frame looks different from the one before
+} Frame;
 
-    switch( curDirection )
-    {
-    case UP:
-        switch( turning )
-        {
-        case TURN_LEFT:
-            (*newCol)--;
-            *newDirection = LEFT;
-            break;
-
-        case STRAIGHT_AHEAD:
-            (*newRow)--;
-            *newDirection = UP;
-            break;
-
-        case TURN_RIGHT:
-            (*newCol)++;
-            *newDirection = RIGHT;
-            break;
-        }
-        break;
-
-    case DOWN:
-        switch( turning )
-        {
-        case TURN_LEFT:
-            (*newCol)++;
-            *newDirection = RIGHT;
-            break;
-
-        case STRAIGHT_AHEAD:
-            (*newRow)++;
-            *newDirection = DOWN;
-            break;
-
-        case TURN_RIGHT:
-            (*newCol)--;
-            *newDirection = LEFT;
-            break;
-        }
-        break;
+#define MAX_CATCH_UP_TICKS TICKS_PER_TURN
+#define DIRECTION_KEYS (KEY_BIT( KEY_RIGHT ) | KEY_BIT( KEY_LEFT ) | KEY_BIT( KEY_DOWN ) | KEY_BIT( KEY_UP ))
 
-    case LEFT:
-        switch( turning )
-        {
-        case TURN_LEFT:
-            (*newRow)++;
-            *newDirection = DOWN;
-            break;
-
-        case STRAIGHT_AHEAD:
-            (*newCol)--;
-            *newDirection = LEFT;
-            break;
-
-        case TURN_RIGHT:
-            (*newRow)--;
-            *newDirection = UP;
-            break;
-        }
-        break;
+#define FRAME_FRESH 4           // Set in the spare index when it is newer than the front frame
 
-    case RIGHT:
-        switch( turning )
-        {
-        case TURN_LEFT:
-            (*newRow)--;
-            *newDirection = UP;
-            break;
-
-        case STRAIGHT_AHEAD:
-            (*newCol)++;
-            *newDirection = RIGHT;
-            break;
-
-        case TURN_RIGHT:
-            (*newRow)++;
-            *newDirection = DOWN;
-            break;
-        }
-        break;
+typedef struct
+{
+    Frame frames[3];
+    alignas(CACHE_LINE_SIZE) atomic_int spare;
+    alignas(CACHE_LINE_SIZE) int back;      // Simulation thread only
+    alignas(CACHE_LINE_SIZE) int front;     // Main thread only
+} FrameExchange;
 
-        default :
-            assert( 0 );
-    }
+typedef struct
+{
+    GameState state;
+    GameState tickStartState;
+    GameState turnStartState;
+    uint64_t tickDuration;      // Nanoseconds
+    uint64_t drift;             // Nanoseconds the game has fallen behind the clock
+    int stalls;                 // Times it fell too far behind to catch up
+    uint64_t moveInputTime;
+    uint64_t moveTickTime;
+    uint32_t viewVersion;
+    InputState input;
+    atomic_bool isRunning;
+    pthread_t thread;
+    FrameExchange exchange;
+} Simulation;
+
+Simulation simulation;
+
+void publishFrame(Simulation *sim, uint64_t tickTime)
+{
+    FrameExchange *exchange = &sim->exchange;
+    Frame *frame = &exchange->frames[ exchange->back ];
+    cloneGameState( &frame->state, &sim->state );
+    cloneGameState( &frame->turnStartState, &sim->turnStartState );
+    frame->tickTime = tickTime;
+    frame->moveInputTime = sim->moveInputTime;
+    frame->moveTickTime = sim->moveTickTime;
+    frame->viewVersion = sim->viewVersion;
+
+    exchange->back = atomic_exchange_explicit( &exchange->spare, exchange->back | FRAME_FRESH,
+            memory_order_acq_rel ) & ~FRAME_FRESH;
 }
 
-Object getFlyScanned(Direction direction, bool isFirefly)
+// Returns the latest published frame, which stays valid until the next call, and whether it has
+// been published since the last call
+const Frame *acquireFrame(FrameExchange *exchange, bool *isNew)
 {
-    Object rtnv;
-
-    switch( direction )
+    *isNew = atomic_load_explicit( &exchange->spare, memory_order_relaxed ) & FRAME_FRESH;
+    if( *isNew )
     {
-    case UP:
-        rtnv = isFirefly ? OBJ_FIREFLY_UP_SCANNED : OBJ_BUTTERFLY_UP_SCANNED;
-        break;
-
-    case DOWN:
-        rtnv = isFirefly ? OBJ_FIREFLY_DOWN_SCANNED : OBJ_BUTTERFLY_DOWN_SCANNED;
-        break;
-
-    case LEFT:
-        rtnv = isFirefly ? OBJ_FIREFLY_LEFT_SCANNED : OBJ_BUTTERFLY_LEFT_SCANNED;
-        break;
-
-    case RIGHT:
-        rtnv = isFirefly ? OBJ_FIREFLY_RIGHT_SCANNED : OBJ_BUTTERFLY_RIGHT_SCANNED;
-        break;
-
-    default :
-        assert( 0 );
+        exchange->front = atomic_exchange_explicit( &exchange->spare, exchange->front,
+                memory_order_acq_rel ) & ~FRAME_FRESH;
     }
-
-    return rtnv;
+    return &exchange->frames[ exchange->front ];
 }
 
-Direction getFlyDirection(Object fly, bool isFirefly)
+// Whether renderGame draws both states the same, given the same turn start. Conservative: any
+// change to a value it reads counts, wherever it is on the cave.
+bool isSameView(const GameState *a, const GameState *b)
 {
-    if( isFirefly )
+    if( a->turn != b->turn || a->loadedCaveNumber != b->loadedCaveNumber || a->caveStride != b->caveStride
+            || a->caveHeight != b->caveHeight )
     {
-        switch( fly )
-        {
-        case OBJ_FIREFLY_UP:
-            return UP;
-        case OBJ_FIREFLY_DOWN:
-            return DOWN;
-        case OBJ_FIREFLY_LEFT:
-            return LEFT;
-        case OBJ_FIREFLY_RIGHT:
-            return RIGHT;
-        default :
-            assert( 0 );
-        }
+        return false;
     }
-    else
+
+    // Rockford's animations run by tick rather than by turn
+    bool isRockfordAnimating = a->rockfordIsMoving || a->rockfordIsBlinking || a->rockfordIsTapping
+            || b->rockfordIsMoving || b->rockfordIsBlinking || b->rockfordIsTapping;
+    if( isRockfordAnimating && a->tick != b->tick )
     {
-        switch( fly )
-        {
-        case OBJ_BUTTERFLY_UP:
-            return UP;
-        case OBJ_BUTTERFLY_DOWN:
-            return DOWN;
-        case OBJ_BUTTERFLY_LEFT:
-            return LEFT;
-        case OBJ_BUTTERFLY_RIGHT:
-            return RIGHT;
-        default :
-            assert( 0 );
-        }
+        return false;
     }
-}
 
-void updateFly(int row, int col, bool isFirefly)
-{
-    if( checkFlyExplode( map[row - 1][col] ) || checkFlyExplode( map[row + 1][col] )
-            || checkFlyExplode( map[row][col - 1] ) || checkFlyExplode( map[row][col + 1] ) )
+    bool isSameStatus = a->livesLeft == b->livesLeft && a->difficultyLevel == b->difficultyLevel
+            && a->diamondsCollected == b->diamondsCollected
+            && a->currentDiamondValue == b->currentDiamondValue
+            && a->caveTimeLeft == b->caveTimeLeft && a->score == b->score
+            && a->isOutOfTimeTextShown == b->isOutOfTimeTextShown && a->isCaveStart == b->isCaveStart
+            && (a->tileCoverTicksLeft == 0) == (b->tileCoverTicksLeft == 0)
+            && a->rockfordTurnsTillBirth == b->rockfordTurnsTillBirth;
+    bool isSameLook = a->cameraX == b->cameraX && a->cameraY == b->cameraY && a->borderColor == b->borderColor
+            && a->magicWallStatus == b->magicWallStatus && a->isAddingTimeToScore == b->isAddingTimeToScore
+            && (a->spaceFlashingTurnsLeft > 0) == (b->spaceFlashingTurnsLeft > 0)
+            && (a->turnsTillExitingCave == 0) == (b->turnsTillExitingCave == 0)
+            && a->rockfordIsFacingRight == b->rockfordIsFacingRight;
+    if( !isSameStatus || !isSameLook )
     {
-        explode( row, col, row, col );
+        return false;
     }
-    else
+
+    return memcmp( a->map, b->map, (a->caveHeight + 2) * a->caveStride ) == 0
+            && memcmp( a->cellCover, b->cellCover, a->caveHeight * a->coverStride * sizeof(uint64_t) ) == 0
+            && memcmp( a->tileCover, b->tileCover, sizeof(a->tileCover) ) == 0;
+}
+
+// Steps the game on a fixed timestep: every tick has a deadline one tick
+// duration after the last one's, on the monotonic clock. After a stall up
+// to MAX_CATCH_UP_TICKS overdue ticks run back to back; anything further
+// behind is dropped and counted as drift, so the game slows down instead
+// of fast-forwarding.
+void *simulationMain(void *arg)
+{
+    Simulation *sim = arg;
+    uint64_t nextTickTime = timer_tick() + sim->tickDuration;
+
+    while( atomic_load_explicit( &sim->isRunning, memory_order_relaxed ) )
     {
-        int direction = getFlyDirection( map[row][col], isFirefly );
-        int newRow, newCol;
-        Direction newDirection;
-        getNewFlyPosition( row, col, direction, (isFirefly ? TURN_LEFT : TURN_RIGHT), &newRow, &newCol,
-                &newDirection );
-        if( map[newRow][newCol] == OBJ_SPACE )
-        {
-            map[newRow][newCol] = getFlyScanned( newDirection, isFirefly );
-            map[row][col] = OBJ_SPACE;
-        }
-        else
+        uint64_t now = timer_tick();
+
+        for( int ticks = 0; now >= nextTickTime; ++ticks )
         {
-            getNewFlyPosition( row, col, direction, STRAIGHT_AHEAD, &newRow, &newCol, &newDirection );
-            if( map[newRow][newCol] == OBJ_SPACE )
+            if( ticks == MAX_CATCH_UP_TICKS )
             {
-                map[newRow][newCol] = getFlyScanned( newDirection, isFirefly );
-                map[row][col] = OBJ_SPACE;
+                sim->drift += now - nextTickTime;
+                ++sim->stalls;
+                nextTickTime = now;
+                break;
             }
-            else
+
+            updateInputState( &sim->input, &inputQueue, nextTickTime );
+            Input input = sampleInput( &sim->input );
+            if( input & KEY_BIT( KEY_QUIT ) )
             {
-                getNewFlyPosition( row, col, direction, (isFirefly ? TURN_RIGHT : TURN_LEFT), &newRow,
-                        &newCol, &newDirection );
-                map[row][col] = getFlyScanned( newDirection, isFirefly );
+                atomic_store( &sim->isRunning, false );
+                wake_controller();
+                break;
             }
-        }
-    }
-}
 
-void addScore(int amount)
-{
-    score += amount;
+            cloneGameState( &sim->tickStartState, &sim->state );
+            stepGame( &sim->state, input );
+            postTickSounds( &sim->tickStartState, &sim->state, nextTickTime );
 
-    // Check for bonus life
-    scoreTillBonusLife -= amount;
-    if( scoreTillBonusLife <= 0 )
-    {
-        scoreTillBonusLife += BONUS_LIFE_COST;
-        spaceFlashingTurnsLeft = SPACE_FLASHING_TURNS;
-        ++livesLeft;
-        if( livesLeft > MAX_LIVES )
-        {
-            livesLeft = MAX_LIVES;
+            if( recordingPath )
+            {
+                recordReplayInput( &recording, input );
+            }
+
+            if( sim->state.tick % TICKS_PER_TURN == 0 )
+            {
+                // Rockford's scan ran this turn and acted on a direction key, moving him to another
+                // cell or snapping the one next to him. The action is timed from when its input was
+                // taken, the press or for a held key this tick's sample, until a frame shows it. A
+                // move blocked by a wall or boulder shows nothing, so it is not timed.
+                uint64_t inputTime = getInputTime( &sim->input, DIRECTION_KEYS );
+                const GameState *before = &sim->tickStartState;
+                bool hasMoved = sim->state.rockfordIsMoving && (sim->state.rockfordRow != before->rockfordRow
+                        || sim->state.rockfordCol != before->rockfordCol);
+                bool hasActed = hasMoved || sim->state.rockfordHasSnapped;
+                if( inputTime && hasActed && sim->state.turnsSinceRockfordSeenAlive == 0 )
+                {
+                    sim->moveInputTime = inputTime;
+                    sim->moveTickTime = nextTickTime;
+                }
+
+                endInputTurn( &sim->input );
+                cloneGameState( &sim->turnStartState, &sim->tickStartState );
+            }
+
+            bool isViewChanged = !isSameView( &sim->tickStartState, &sim->state );
+            sim->viewVersion += isViewChanged;
+            publishFrame( sim, nextTickTime );
+            nextTickTime += sim->tickDuration;
+            if( isViewChanged )
+            {
+                wake_controller();
+            }
         }
+
+        timer_sleep_until( nextTickTime );
     }
+
+    return NULL;
 }
 
-bool isIntermission( void )
+void startSimulation(Simulation *sim)
 {
-    return ((currentCaveNumber + 1) % 5) == 0;
+    FrameExchange *exchange = &sim->exchange;
+    exchange->front = 0;
+    exchange->spare = 1;
+    exchange->back = 2;
+
+    // The main thread has a frame to draw from the start
+    cloneGameState( &sim->turnStartState, &sim->state );
+    sim->viewVersion = 1;
+    publishFrame( sim, timer_tick() );
+
+    atomic_store( &sim->isRunning, true );
+    int rslt = pthread_create( &sim->thread, NULL, simulationMain, sim );
+    assert( 0 == rslt );
 }
 
-void incrementCaveNumber( void )
+// Runs at exit, before the recording is saved, however the game was quit
+void stopSimulation(void)
 {
-    ++currentCaveNumber;
-    if( currentCaveNumber >= CAVE_COUNT )
+    atomic_store( &simulation.isRunning, false );
+    pthread_join( simulation.thread, NULL );
+
+    if( simulation.stalls > 0 )
     {
-        currentCaveNumber = 0;
-        if( difficultyLevel < NUM_DIFFICULTY_LEVELS - 1 )
-        {
-            ++difficultyLevel;
-        }
+        printf( "Game clock fell %.3f s behind in %d stalls\n", simulation.drift / 1e9, simulation.stalls );
     }
 }
 
-char getCurrentCaveLetter( void )
-{
-    switch( currentCaveNumber )
-    {
-    case CAVE_A:
-        return 'A';
-    case CAVE_B:
-        return 'B';
-    case CAVE_C:
-        return 'C';
-    case CAVE_D:
-        return 'D';
-    case CAVE_E:
-        return 'E';
-    case CAVE_F:
-        return 'F';
-    case CAVE_G:
-        return 'G';
-    case CAVE_H:
-        return 'H';
-    case CAVE_I:
-        return 'I';
-    case CAVE_J:
-        return 'J';
-    case CAVE_K:
-        return 'K';
-    case CAVE_L:
-        return 'L';
-    case CAVE_M:
-        return 'M';
-    case CAVE_N:
-        return 'N';
-    case CAVE_O:
-        return 'O';
-    case CAVE_P:
-        return 'P';
-    }
-    return ' ';
-}
+//
+// Move latency
+//
+// Every move or snap Rockford makes is timed from its input to the return
+// of the first present that shows it, split at the tick that made it. The
+// input time is the key event for a fresh press and the tick's sample for
+// a key held down. Printed at exit, or on SIGUSR1.
+//
 
-bool canAmoebaGrowHere(int row, int col)
-{
-    return map[row][col] == OBJ_SPACE || map[row][col] == OBJ_DIRT;
-}
+latency_histogram moveLatency;
+latency_histogram pressToTickLatency;
+latency_histogram tickToPresentLatency;
+volatile sig_atomic_t isLatencyPrintRequested;
 
-void getRandomCellNear(int row, int col, int *newRow, int *newCol)
+void printMoveLatency(void)
 {
-    *newRow = row;
-    *newCol = col;
-    switch( rand() % DIRECTION_COUNT )
+    if( moveLatency.count > 0 )
     {
-    case UP:
-        (*newRow)--;
-        break;
-    case DOWN:
-        (*newRow)++;
-        break;
-    case LEFT:
-        (*newCol)--;
-        break;
-    case RIGHT:
-        (*newCol)++;
-        break;
-    default :
-        assert( 0 );
+        latency_print( &moveLatency, "Input to present" );
+        latency_print( &pressToTickLatency, "  input to tick" );
+        latency_print( &tickToPresentLatency, "  tick to present" );
     }
 }
 
-////////////////
-
-bool isKeyDown(uint8_t virtKey)
+void requestLatencyPrint(int signal)
 {
-    bool rtnv = 0;
-    extern bool keyPressed;
-    extern uint8_t keyVal;
-    if( virtKey == keyVal )
-    {
-        rtnv = keyPressed;
-    }
-    return rtnv;
+    (void) signal;
+    isLatencyPrintRequested = 1;
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
     //
     // Initialise graphics
     //
 
-    backbuffer = frame_buffer_init();
+    backbuffer = frame_buffer_init( bmiColors );
+
+    uint64_t perfc = timer_tick();
 
     //
-    // Clock
+    // Command line: [--record file] [turns [seed]], or when headless --replay file... or
+    // --render-hash [-j bands] file...
     //
 
-    float dt = 0.0f;
-    float targetFps = 60.0f;
-    float maxDt = 1.0f / targetFps;
-    uint64_t perfcFreq = 100000ULL;
-    uint64_t perfc = 0ULL;
-    uint64_t perfcPrev = 0;
+    int headlessTurns = HEADLESS_DEFAULT_TURNS;
+    uint64_t headlessStart = perfc;
+
+    // Headless runs are reproducible by default, interactive games are not
+    uint32_t seed = HEADLESS ? 1 : (uint32_t) perfc;
+
+    int arg = 1;
+
+    if( argc > arg + 1 && strcmp( argv[arg], "--record" ) == 0 )
+    {
+        recordingPath = argv[arg + 1];
+        arg += 2;
+    }
+    if( HEADLESS && argc > arg && strcmp( argv[arg], "--replay" ) == 0 )
+    {
+        return verifyReplays( argc - arg - 1, argv + arg + 1 );
+    }
 
-    perfc = timer_tick();
+    // Replays are drawn once the cave colours are set up
+    bool isRenderHashing = HEADLESS && argc > arg && strcmp( argv[arg], "--render-hash" ) == 0;
+    int renderHashBands = (int) sysconf( _SC_NPROCESSORS_ONLN );
+    if( isRenderHashing )
+    {
+        ++arg;
+        if( argc > arg + 1 && strcmp( argv[arg], "-j" ) == 0 )
+        {
+            renderHashBands = atoi( argv[arg + 1] );
+            arg += 2;
+        }
+    }
+    if( argc > arg && !isRenderHashing )
+    {
+        headlessTurns = atoi( argv[arg++] );
+    }
+    if( argc > arg && !isRenderHashing )
+    {
+        seed = strtoul( argv[arg++], NULL, 0 );
+    }
 
     //
     // Initialize cave colors
@@ -1016,1124 +1820,118 @@ int main(void)
     caveColors[INTERMISSION_4].brickWallBg = GREEN;
     caveColors[INTERMISSION_4].dirtFg = YELLOW;
 
-    //
-    // Initialise game
-    //
-
-    bool cellCover[CAVE_HEIGHT][CAVE_WIDTH];
-    bool tileCover[PLAYFIELD_HEIGHT_IN_TILES][PLAYFIELD_WIDTH_IN_TILES];
-    char statusBarText[PLAYFIELD_WIDTH_IN_TILES];
-    CaveColors curColors;
-
-    int turn = 0;
-    int tick = 0;
-    float tickTimer = 0;
-    float tickDuration = DEV_SLOW_TICK_DURATION ? 0.15f : 0.03375f;
-
-    bool isGameStart = true;
-    int turnsTillGameRestart = 0;
-    int turnsTillExitingCave = 0;
-    bool isAddingTimeToScore = false;
-
-    Color normalBorderColor = BLACK;
-    Color flashBorderColor = GRAY;
-    Color borderColor = normalBorderColor;
-
-    int cameraX = 0;
-    int cameraY = 0;
-    int cameraVelX = 0;
-    int cameraVelY = 0;
+    if( isRenderHashing )
+    {
+        return verifyRenderHashes( argc - arg, argv + arg, renderHashBands, caveColors );
+    }
 
     //
-    // These variables are initialised when game starts
+    // Initialise game
     //
 
-    bool isCaveStart;
-    int pauseTurnsLeft;
+    GameState *state = &simulation.state;
+    initGameState( state, START_CAVE, 0, seed );
 
-    //
-    // These variables are initialised when cave starts
-    //
+    // Frame buffer backends may exit() directly, so the recording is saved from an exit handler
+    if( recordingPath )
+    {
+        initReplay( &recording, seed, START_CAVE, 0 );
+        recordingState = state;
+        atexit( saveRecording );
+    }
 
-    bool isExitingCave;
-    int caveTimeLeft;
-    int ticksTillNextCaveSecond;
-    bool isOutOfTimeTextShown;
-    int outOfTimeTurn = 0;
-    int diamondsCollected;
-    int currentDiamondValue;
-    int rockfordTurnsTillBirth;
-    int cellCoverTurnsLeft;
-    int tileCoverTicksLeft;
-
-    int rockfordCol;
-    int rockfordRow;
-    bool rockfordIsBlinking;
-    bool rockfordIsTapping;
-    bool rockfordIsMoving;
-    bool rockfordIsFacingRight;
-
-    int amoebaSlowGrowthTimeLeft;
-    int magicWallMillingTimeLeft;
-
-    int numberOfAmoebaFoundThisTurn;
-    int totalAmoebaFoundLastTurn;
-    bool amoebaSuffocatedLastTurn;
-    bool atLeastOneAmoebaFoundThisTurnWhichCanGrow;
+    simulation.tickDuration = DEV_SLOW_TICK_DURATION ? 150000000 : 33750000;
 
     //
-    // Game loop
+    // Headless game loop
     //
 
-    bool gameIsRunning = true;
-
-    while( gameIsRunning )
+    if( HEADLESS )
     {
-        perfcPrev = perfc;
-        perfc = timer_tick();
-        dt = (float) (perfc - perfcPrev) / (float) perfcFreq;
-        //printf("dt: %f\n", dt);
-        if( dt > maxDt )
-        {
-            dt = maxDt;
-        }
-
-        // Handle Windows messages
-        if( isKeyDown( KEY_QUIT ) )
-        {
-            gameIsRunning = false;
-        }
-
-        // Initialisation on game start
-        if( isGameStart )
-        {
-            isGameStart = false;
-
-            isCaveStart = true;
-            pauseTurnsLeft = 0;
-            currentCaveNumber = START_CAVE;
-            difficultyLevel = 0;
-            livesLeft = DEV_SINGLE_LIFE ? 1 : 3;
-            score = 0;
-            scoreTillBonusLife = BONUS_LIFE_COST;
-            spaceFlashingTurnsLeft = 0;
-        }
-
-        // Initialisation on cave start
-        if( isCaveStart && pauseTurnsLeft == 0 )
+        while( state->turn < headlessTurns )
         {
-            isCaveStart = false;
-
-            decodeCave( currentCaveNumber );
-            curColors = caveColors[currentCaveNumber];
-
-            isExitingCave = false;
-            turnsSinceRockfordSeenAlive = 0;
-            diamondsCollected = 0;
-            currentDiamondValue = caveInfo->initialDiamondValue;
-            caveTimeLeft = DEV_QUICK_OUT_OF_TIME ? 5 : caveInfo->caveTime[difficultyLevel];
-
-            amoebaSlowGrowthTimeLeft = caveInfo->magicWallMillingTime;
-            magicWallMillingTimeLeft = caveInfo->magicWallMillingTime;
-
-            ticksTillNextCaveSecond = TICKS_PER_CAVE_SECOND;
-            isOutOfTime = false;
-            isOutOfTimeTextShown = false;
-            outOfTimeTurn = 0;
-            rockfordTurnsTillBirth = DEV_IMMEDIATE_STARTUP ? 0 : ROCKFORD_TURNS_TILL_BIRTH;
-            cellCoverTurnsLeft = DEV_IMMEDIATE_STARTUP ? 1 : CELL_COVER_TURNS;
-            magicWallStatus = MAGIC_WALL_OFF;
-
-            numberOfAmoebaFoundThisTurn = 0;
-            totalAmoebaFoundLastTurn = 0;
-            amoebaSuffocatedLastTurn = false;
-            atLeastOneAmoebaFoundThisTurnWhichCanGrow = true;
-
-            rockfordIsBlinking = false;
-            rockfordIsTapping = false;
-            tileCoverTicksLeft = 0;
-            rockfordIsMoving = false;
-            rockfordIsFacingRight = true;
-
-            if( DEV_SINGLE_DIAMOND_NEEDED )
-            {
-                caveInfo->diamondsNeeded[difficultyLevel] = 1;
-            }
-
-            for( int row = 0; row < CAVE_HEIGHT; ++row )
-            {
-                for( int col = 0; col < CAVE_WIDTH; ++col )
-                {
-                    cellCover[row][col] = true;
-                }
-            }
+            Input input = 0;    // No input ever arrives headless
+            stepGame( state, input );
 
-            for( int row = 0; row < PLAYFIELD_HEIGHT_IN_TILES; ++row )
+            if( recordingPath )
             {
-                for( int col = 0; col < PLAYFIELD_WIDTH_IN_TILES; ++col )
-                {
-                    tileCover[row][col] = false;
-                }
-            }
-
-            // Find initial rockford position
-            for( int row = 0; row < CAVE_HEIGHT; ++row )
-            {
-                for( int col = 0; col < CAVE_WIDTH; ++col )
-                {
-                    if( map[row][col] == OBJ_PRE_ROCKFORD_1 )
-                    {
-                        rockfordRow = row;
-                        rockfordCol = col;
-                        if( DEV_NEAR_OUTBOX )
-                        {
-                            map[row - 1][col] = OBJ_FLASHING_OUTBOX;
-                        }
-                    }
-                }
+                recordReplayInput( &recording, input );
             }
         }
 
-        tickTimer += dt;
-
-        if( tickTimer >= tickDuration )
-        {
-            tickTimer -= tickDuration;
-            tick++;
-
-            //
-            // Do tick
-            //
-
-            int rockfordRectLeft = PLAYFIELD_LEFT + rockfordCol * CELL_SIZE - cameraX;
-            int rockfordRectTop = PLAYFIELD_TOP + rockfordRow * CELL_SIZE - cameraY;
-            int rockfordRectRight = rockfordRectLeft + CELL_SIZE;
-            int rockfordRectBottom = rockfordRectTop + CELL_SIZE;
-
-            if( isAddingTimeToScore )
-            {
-                if( caveTimeLeft > 0 )
-                {
-                    --caveTimeLeft;
-                    addScore( 1 );
-                }
-                else
-                {
-                    isAddingTimeToScore = false;
-                    isExitingCave = true;
-                    incrementCaveNumber();
-                    turnsTillExitingCave = TURNS_TILL_EXITING_CAVE;
-                }
-            }
-            else
-            {
-                //
-                // Update cave timer
-                //
-
-                if( turnsTillExitingCave == 0 && tileCoverTicksLeft == 0 && rockfordTurnsTillBirth == 0
-                        && !isOutOfTime )
-                {
-                    --ticksTillNextCaveSecond;
-                    if( ticksTillNextCaveSecond == 0 )
-                    {
-                        ticksTillNextCaveSecond = TICKS_PER_CAVE_SECOND;
-                        if( caveTimeLeft > 0 )
-                        {
-                            --caveTimeLeft;
-
-                            if( amoebaSlowGrowthTimeLeft > 0 )
-                            {
-                                --amoebaSlowGrowthTimeLeft;
-                            }
-
-                            if( magicWallStatus == MAGIC_WALL_ON )
-                            {
-                                --magicWallMillingTimeLeft;
-                                if( magicWallMillingTimeLeft == 0 )
-                                {
-                                    magicWallStatus = MAGIC_WALL_EXPIRED;
-                                }
-                            }
-                        }
-                        else
-                        {
-                            isOutOfTime = true;
-                            isOutOfTimeTextShown = true;
-                        }
-                    }
-                }
-
-                //
-                // Turn-based update logic
-                //
-
-                if( tick % TICKS_PER_TURN == 0 )
-                {
-                    if( pauseTurnsLeft > 0 )
-                    {
-                        pauseTurnsLeft--;
-                    }
-                    else
-                    {
-                        turn++;
-
-                        //
-                        // Do turn
-                        //
-
-                        borderColor = normalBorderColor;
-
-                        if( turnsTillExitingCave == 0 && spaceFlashingTurnsLeft > 0 )
-                        {
-                            --spaceFlashingTurnsLeft;
-                        }
-
-                        if( magicWallStatus == MAGIC_WALL_ON )
-                        {
-                        }
-
-                        //
-                        // Move camera
-                        //
-
-                        if( rockfordRectRight > CAMERA_START_RIGHT )
-                        {
-                            cameraVelX = CAMERA_STEP;
-                        }
-                        else if( rockfordRectLeft < CAMERA_START_LEFT )
-                        {
-                            cameraVelX = -CAMERA_STEP;
-                        }
-                        if( rockfordRectBottom > CAMERA_START_BOTTOM )
-                        {
-                            cameraVelY = CAMERA_STEP;
-                        }
-                        else if( rockfordRectTop < CAMERA_START_TOP )
-                        {
-                            cameraVelY = -CAMERA_STEP;
-                        }
-
-                        if( rockfordRectLeft >= CAMERA_STOP_LEFT && rockfordRectRight <= CAMERA_STOP_RIGHT )
-                        {
-                            cameraVelX = 0;
-                        }
-                        if( rockfordRectTop >= CAMERA_STOP_TOP && rockfordRectBottom <= CAMERA_STOP_BOTTOM )
-                        {
-                            cameraVelY = 0;
-                        }
-
-                        cameraX += cameraVelX;
-                        cameraY += cameraVelY;
-
-                        if( cameraX < CAMERA_X_MIN )
-                        {
-                            cameraX = CAMERA_X_MIN;
-                        }
-                        else if( cameraX > CAMERA_X_MAX )
-                        {
-                            cameraX = CAMERA_X_MAX;
-                        }
-
-                        if( cameraY < CAMERA_Y_MIN )
-                        {
-                            cameraY = CAMERA_Y_MIN;
-                        }
-                        else if( cameraY > CAMERA_Y_MAX )
-                        {
-                            cameraY = CAMERA_Y_MAX;
-                        }
-
-                        //
-                        // Out of time
-                        //
-
-                        if( isOutOfTime )
-                        {
-                            ++outOfTimeTurn;
-                            if( isOutOfTimeTextShown )
-                            {
-                                if( outOfTimeTurn == OUT_OF_TIME_ON_TURNS )
-                                {
-                                    outOfTimeTurn = 0;
-                                    isOutOfTimeTextShown = false;
-                                }
-                            }
-                            else
-                            {
-                                if( outOfTimeTurn == OUT_OF_TIME_OFF_TURNS )
-                                {
-                                    outOfTimeTurn = 0;
-                                    isOutOfTimeTextShown = true;
-                                }
-                            }
-                        }
-
-                        //////////////////////
-
-                        if( turnsTillGameRestart > 0 )
-                        {
-                            --turnsTillGameRestart;
-                            if( turnsTillGameRestart == 0 )
-                            {
-                                isGameStart = true;
-                            }
-                        }
-                        else if( turnsTillExitingCave > 0 )
-                        {
-                            --turnsTillExitingCave;
-                            if( turnsTillExitingCave == 0 )
-                            {
-                                tileCoverTicksLeft = TILE_COVER_TICKS;
-                            }
-                        }
-                        else if( isExitingCave )
-                        {
-                            // Do nothing
-                        }
-                        else if( cellCoverTurnsLeft > 0 )
-                        {
-                            //
-                            // Update cell cover
-                            //
-
-                            cellCoverTurnsLeft--;
-                            if( cellCoverTurnsLeft > 1 )
-                            {
-                                for( int row = 0; row < CAVE_HEIGHT; ++row )
-                                {
-                                    for( int i = 0; i < 3; ++i )
-                                    {
-                                        cellCover[row][rand() % CAVE_WIDTH] = false;
-                                    }
-                                }
-                            }
-                            else if( cellCoverTurnsLeft == 1 )
-                            {
-                                pauseTurnsLeft = COVER_PAUSE;
-                            }
-                            else if( cellCoverTurnsLeft == 0 )
-                            {
-                                for( int row = 0; row < CAVE_HEIGHT; ++row )
-                                {
-                                    for( int col = 0; col < CAVE_WIDTH; ++col )
-                                    {
-                                        cellCover[row][col] = false;
-                                    }
-                                }
-                            }
-                        }
-                        else
-                        {
-                            //
-                            // Before cave scanning
-                            //
-
-                            ++turnsSinceRockfordSeenAlive;
-
-                            /////
-
-                            totalAmoebaFoundLastTurn = numberOfAmoebaFoundThisTurn;
-                            numberOfAmoebaFoundThisTurn = 0;
-
-                            amoebaSuffocatedLastTurn = !atLeastOneAmoebaFoundThisTurnWhichCanGrow;
-                            atLeastOneAmoebaFoundThisTurnWhichCanGrow = false;
-
-                            //
-                            // Scan cave
-                            //
-
-                            for( int row = 0; row < CAVE_HEIGHT; ++row )
-                            {
-                                for( int col = 0; col < CAVE_WIDTH; ++col )
-                                {
-                                    switch( map[row][col] )
-                                    {
-                                    case OBJ_PRE_ROCKFORD_1:
-                                        turnsSinceRockfordSeenAlive = 0;
-                                        if( rockfordTurnsTillBirth == 0 )
-                                        {
-                                            map[row][col] = OBJ_PRE_ROCKFORD_2;
-                                        }
-                                        else if( cellCoverTurnsLeft == 0 )
-                                        {
-                                            rockfordTurnsTillBirth--;
-                                        }
-                                        break;
-
-                                    case OBJ_PRE_ROCKFORD_2:
-                                        turnsSinceRockfordSeenAlive = 0;
-                                        map[row][col] = OBJ_PRE_ROCKFORD_3;
-                                        break;
-
-                                    case OBJ_PRE_ROCKFORD_3:
-                                        turnsSinceRockfordSeenAlive = 0;
-                                        map[row][col] = OBJ_PRE_ROCKFORD_4;
-                                        break;
-
-                                    case OBJ_PRE_ROCKFORD_4:
-                                        turnsSinceRockfordSeenAlive = 0;
-                                        map[row][col] = OBJ_ROCKFORD;
-                                        break;
-
-                                        //
-                                        // Update Rockford
-                                        //
-
-                                    case OBJ_ROCKFORD:
-                                    {
-                                        turnsSinceRockfordSeenAlive = 0;
-
-                                        int newRow = row;
-                                        int newCol = col;
-
-                                        rockfordIsMoving = false;
-
-                                        if( !isOutOfTime && tileCoverTicksLeft == 0 )
-                                        {
-                                            if( isKeyDown( KEY_RIGHT ) )
-                                            {
-                                                rockfordIsMoving = true;
-                                                rockfordIsFacingRight = true;
-                                                ++newCol;
-                                            }
-                                            else if( isKeyDown( KEY_LEFT ) )
-                                            {
-                                                rockfordIsMoving = true;
-                                                rockfordIsFacingRight = false;
-                                                --newCol;
-                                            }
-                                            else if( isKeyDown( KEY_DOWN ) )
-                                            {
-                                                rockfordIsMoving = true;
-                                                ++newRow;
-                                            }
-                                            else if( isKeyDown( KEY_UP ) )
-                                            {
-                                                rockfordIsMoving = true;
-                                                --newRow;
-                                            }
-                                        }
-
-                                        bool actuallyMoved = false;
-
-                                        switch( map[newRow][newCol] )
-                                        {
-                                        case OBJ_SPACE:
-                                            actuallyMoved = true;
-                                            break;
-
-                                        case OBJ_DIRT:
-                                            actuallyMoved = true;
-                                            break;
-
-                                        case OBJ_DIAMOND_STATIONARY:
-                                        case OBJ_DIAMOND_STATIONARY_SCANNED:
-                                            //
-                                            // Pick up a diamond
-                                            //
-
-                                            actuallyMoved = true;
-                                            addScore( currentDiamondValue );
-
-                                            // Check if all the needed diamonds for this cave were collected
-                                            ++diamondsCollected;
-                                            if( diamondsCollected
-                                                    == caveInfo->diamondsNeeded[difficultyLevel] )
-                                            {
-                                                currentDiamondValue = caveInfo->extraDiamondValue;
-                                                borderColor = flashBorderColor;
-                                            }
-                                            break;
-
-                                        case OBJ_BOULDER_STATIONARY:
-                                        case OBJ_BOULDER_STATIONARY_SCANNED:
-                                            // Pushing boulders
-                                            if( rand() % 4 == 0 )
-                                            {
-                                                if( isKeyDown( KEY_RIGHT )
-                                                        && map[newRow][newCol + 1] == OBJ_SPACE )
-                                                {
-                                                    map[newRow][newCol + 1] = OBJ_BOULDER_STATIONARY_SCANNED;
-                                                    actuallyMoved = true;
-                                                }
-                                                else if( isKeyDown( KEY_LEFT )
-                                                        && map[newRow][newCol - 1] == OBJ_SPACE )
-                                                {
-                                                    map[newRow][newCol - 1] = OBJ_BOULDER_STATIONARY_SCANNED;
-                                                    actuallyMoved = true;
-                                                }
-                                            }
-                                            break;
-
-                                        case OBJ_FLASHING_OUTBOX:
-                                            actuallyMoved = true;
-                                            isAddingTimeToScore = true;
-                                            break;
-                                        }
-
-                                        if( actuallyMoved )
-                                        {
-                                            if( isKeyDown( KEY_FIRE ) )
-                                            {
-                                                map[newRow][newCol] = OBJ_SPACE;
-                                            }
-                                            else
-                                            {
-                                                map[row][col] = OBJ_SPACE;
-                                                map[newRow][newCol] = OBJ_ROCKFORD_SCANNED;
-                                                rockfordRow = newRow;
-                                                rockfordCol = newCol;
-                                            }
-                                        }
-
-                                        //
-                                        // Update Rockford idle animation
-                                        //
-
-                                        if( rockfordIsMoving )
-                                        {
-                                            rockfordIsBlinking = false;
-                                            rockfordIsTapping = false;
-                                        }
-                                        else
-                                        {
-                                            if( tick % 8 == 0 )
-                                            {
-                                                rockfordIsBlinking = rand() % 4 == 0;
-                                                if( rand() % 16 == 0 )
-                                                {
-                                                    rockfordIsTapping = !rockfordIsTapping;
-                                                }
-                                            }
-                                        }
-                                        break;
-                                    }
-
-                                        //
-                                        // Update boulders and diamonds
-                                        //
-
-                                    case OBJ_BOULDER_STATIONARY:
-                                    case OBJ_BOULDER_FALLING:
-                                        updateBoulderAndDiamond( row, col,
-                                                map[row][col] == OBJ_BOULDER_FALLING, true );
-                                        break;
-
-                                    case OBJ_DIAMOND_STATIONARY:
-                                    case OBJ_DIAMOND_FALLING:
-                                        updateBoulderAndDiamond( row, col,
-                                                map[row][col] == OBJ_DIAMOND_FALLING, false );
-                                        break;
-
-                                        //
-                                        // Update explosion
-                                        //
-
-                                    case OBJ_EXPLODE_TO_SPACE_0:
-                                        map[row][col] = OBJ_EXPLODE_TO_SPACE_1;
-                                        break;
-                                    case OBJ_EXPLODE_TO_SPACE_1:
-                                        map[row][col] = OBJ_EXPLODE_TO_SPACE_2;
-                                        break;
-                                    case OBJ_EXPLODE_TO_SPACE_2:
-                                        map[row][col] = OBJ_EXPLODE_TO_SPACE_3;
-                                        break;
-                                    case OBJ_EXPLODE_TO_SPACE_3:
-                                        map[row][col] = OBJ_EXPLODE_TO_SPACE_4;
-                                        break;
-                                    case OBJ_EXPLODE_TO_SPACE_4:
-                                        map[row][col] = OBJ_SPACE;
-                                        break;
-
-                                    case OBJ_EXPLODE_TO_DIAMOND_0:
-                                        map[row][col] = OBJ_EXPLODE_TO_DIAMOND_1;
-                                        break;
-                                    case OBJ_EXPLODE_TO_DIAMOND_1:
-                                        map[row][col] = OBJ_EXPLODE_TO_DIAMOND_2;
-                                        break;
-                                    case OBJ_EXPLODE_TO_DIAMOND_2:
-                                        map[row][col] = OBJ_EXPLODE_TO_DIAMOND_3;
-                                        break;
-                                    case OBJ_EXPLODE_TO_DIAMOND_3:
-                                        map[row][col] = OBJ_EXPLODE_TO_DIAMOND_4;
-                                        break;
-                                    case OBJ_EXPLODE_TO_DIAMOND_4:
-                                        map[row][col] = OBJ_DIAMOND_STATIONARY;
-                                        break;
-
-                                        //
-                                        // Update out box
-                                        //
-
-                                    case OBJ_PRE_OUTBOX:
-                                        if( diamondsCollected >= caveInfo->diamondsNeeded[difficultyLevel] )
-                                        {
-                                            map[row][col] = OBJ_FLASHING_OUTBOX;
-                                        }
-                                        break;
-
-                                        //
-                                        // Update fireflies and butterflies
-                                        //
-
-                                    case OBJ_FIREFLY_LEFT:
-                                    case OBJ_FIREFLY_UP:
-                                    case OBJ_FIREFLY_RIGHT:
-                                    case OBJ_FIREFLY_DOWN:
-                                        updateFly( row, col, true );
-                                        break;
-
-                                    case OBJ_BUTTERFLY_LEFT:
-                                    case OBJ_BUTTERFLY_UP:
-                                    case OBJ_BUTTERFLY_RIGHT:
-                                    case OBJ_BUTTERFLY_DOWN:
-                                        updateFly( row, col, false );
-                                        break;
-
-                                        //
-                                        // Update amoeba
-                                        //
-
-                                    case OBJ_AMOEBA:
-                                        ++numberOfAmoebaFoundThisTurn;
-                                        if( totalAmoebaFoundLastTurn >= TOO_MANY_AMOEBA )
-                                        {
-                                            map[row][col] = OBJ_BOULDER_STATIONARY;
-                                        }
-                                        else if( amoebaSuffocatedLastTurn )
-                                        {
-                                            map[row][col] = OBJ_DIAMOND_STATIONARY;
-                                        }
-                                        else
-                                        {
-                                            if( !atLeastOneAmoebaFoundThisTurnWhichCanGrow )
-                                            {
-                                                atLeastOneAmoebaFoundThisTurnWhichCanGrow = canAmoebaGrowHere(
-                                                        row - 1, col ) || canAmoebaGrowHere( row + 1, col )
-                                                        || canAmoebaGrowHere( row, col - 1 )
-                                                        || canAmoebaGrowHere( row, col + 1 );
-                                            }
-                                            int amoebaRandomFactor =
-                                                    amoebaSlowGrowthTimeLeft > 0 ?
-                                                            AMOEBA_FACTOR_SLOW : AMOEBA_FACTOR_FAST;
-                                            if( (rand() % amoebaRandomFactor) < 4 )
-                                            {
-                                                int newRow, newCol;
-                                                getRandomCellNear( row, col, &newRow, &newCol );
-                                                if( canAmoebaGrowHere( newRow, newCol ) )
-                                                {
-                                                    map[newRow][newCol] = OBJ_AMOEBA;
-                                                }
-                                            }
-                                        }
-                                        break;
-                                    }
-                                }
-                            }
-
-                            //
-                            // Remove scanned status for cells
-                            //
-
-                            for( int row = 0; row < CAVE_HEIGHT; ++row )
-                            {
-                                for( int col = 0; col < CAVE_WIDTH; ++col )
-                                {
-                                    switch( map[row][col] )
-                                    {
-                                    case OBJ_FIREFLY_LEFT_SCANNED:
-                                        map[row][col] = OBJ_FIREFLY_LEFT;
-                                        break;
-                                    case OBJ_FIREFLY_UP_SCANNED:
-                                        map[row][col] = OBJ_FIREFLY_UP;
-                                        break;
-                                    case OBJ_FIREFLY_RIGHT_SCANNED:
-                                        map[row][col] = OBJ_FIREFLY_RIGHT;
-                                        break;
-                                    case OBJ_FIREFLY_DOWN_SCANNED:
-                                        map[row][col] = OBJ_FIREFLY_DOWN;
-                                        break;
-                                    case OBJ_BOULDER_STATIONARY_SCANNED:
-                                        map[row][col] = OBJ_BOULDER_STATIONARY;
-                                        break;
-                                    case OBJ_BOULDER_FALLING_SCANNED:
-                                        map[row][col] = OBJ_BOULDER_FALLING;
-                                        break;
-                                    case OBJ_DIAMOND_STATIONARY_SCANNED:
-                                        map[row][col] = OBJ_DIAMOND_STATIONARY;
-                                        break;
-                                    case OBJ_DIAMOND_FALLING_SCANNED:
-                                        map[row][col] = OBJ_DIAMOND_FALLING;
-                                        break;
-                                    case OBJ_BUTTERFLY_DOWN_SCANNED:
-                                        map[row][col] = OBJ_BUTTERFLY_DOWN;
-                                        break;
-                                    case OBJ_BUTTERFLY_LEFT_SCANNED:
-                                        map[row][col] = OBJ_BUTTERFLY_LEFT;
-                                        break;
-                                    case OBJ_BUTTERFLY_UP_SCANNED:
-                                        map[row][col] = OBJ_BUTTERFLY_UP;
-                                        break;
-                                    case OBJ_BUTTERFLY_RIGHT_SCANNED:
-                                        map[row][col] = OBJ_BUTTERFLY_RIGHT;
-                                        break;
-                                    case OBJ_ROCKFORD_SCANNED:
-                                        map[row][col] = OBJ_ROCKFORD;
-                                        break;
-                                    case OBJ_AMOEBA_SCANNED:
-                                        map[row][col] = OBJ_AMOEBA;
-                                        break;
-                                    }
-                                }
-                            }
-
-                            //
-                            // Handle failure
-                            //
-
-                            if( tileCoverTicksLeft == 0 && rockfordTurnsTillBirth == 0
-                                    && ((isFailed() && isKeyDown( KEY_FIRE )) || isKeyDown( KEY_FAIL )) )
-                            {
-                                tileCoverTicksLeft = TILE_COVER_TICKS;
-                                if( isIntermission() )
-                                {
-                                    incrementCaveNumber();
-                                }
-                                else
-                                {
-                                    --livesLeft;
-                                }
-                            }
-                        }
-                    }
-                }
-
-                //
-                // Update tile cover
-                //
-
-                if( tileCoverTicksLeft > 0 )
-                {
-                    --tileCoverTicksLeft;
-
-                    if( tileCoverTicksLeft == 0 )
-                    {
-                        if( livesLeft == 0 )
-                        {
-                            for( int row = 0; row < PLAYFIELD_HEIGHT_IN_TILES; ++row )
-                            {
-                                for( int col = 0; col < PLAYFIELD_WIDTH_IN_TILES; ++col )
-                                {
-                                    tileCover[row][col] = true;
-                                }
-                            }
-                            turnsTillGameRestart = TURNS_TILL_GAME_RESTART;
-                        }
-                        else
-                        {
-                            pauseTurnsLeft = COVER_PAUSE;
-                            isCaveStart = true;
-                        }
-                    }
-                    else
-                    {
-                        for( int i = 0; i < 7; ++i )
-                        {
-                            int row = rand() % PLAYFIELD_HEIGHT_IN_TILES;
-                            int col = rand() % PLAYFIELD_WIDTH_IN_TILES;
-                            tileCover[row][col] = true;
-                        }
-                    }
-                }
-            }
-
-            //
-            // Update status bar
-            //
-
-            if( livesLeft == 0 )
-            {
-                snprintf( statusBarText, sizeof(statusBarText), "        G A M E  O V E R" );
-            }
-            else if( isOutOfTimeTextShown && tileCoverTicksLeft == 0 )
-            {
-                snprintf( statusBarText, sizeof(statusBarText), "     O U T   O F   T I M E" );
-            }
-            else
-            {
-                if( rockfordTurnsTillBirth > 0 || tileCoverTicksLeft > 0 || isCaveStart )
-                {
-                    if( isIntermission() )
-                    {
-                        snprintf( statusBarText, sizeof(statusBarText), "       B O N U S  L I F E" );
-                    }
-                    else
-                    {
-                        snprintf( statusBarText, sizeof(statusBarText), "  PLAYER 1,  %d MEN,  ROOM %c/%d",
-                                livesLeft, getCurrentCaveLetter(), difficultyLevel + 1 );
-                    }
-                }
-                else
-                {
-                    if( diamondsCollected < caveInfo->diamondsNeeded[difficultyLevel] )
-                    {
-                        snprintf( statusBarText, sizeof(statusBarText), "   %02d*%02d   %02d   %03d   %06d",
-                                caveInfo->diamondsNeeded[difficultyLevel], currentDiamondValue,
-                                diamondsCollected, caveTimeLeft, score );
-                    }
-                    else
-                    {
-                        snprintf( statusBarText, sizeof(statusBarText), "   ***%02d   %02d   %03d   %06d",
-                                currentDiamondValue, diamondsCollected, caveTimeLeft, score );
-                    }
-                }
-            }
-
-            //
-            // Render
-            //
+        double seconds = (double) timer_get_relative( headlessStart ) / 1e9;
+        printf( "%d turns, %d ticks in %.3f s: %.0f turns/s\n", state->turn, state->tick, seconds,
+                state->turn / seconds );
+        return 0;
+    }
 
-            // Draw border
-            drawFilledRect( 0, 0, BACKBUFFER_WIDTH - 1, BACKBUFFER_HEIGHT - 1, borderColor );
+    //
+    // Game loop: the simulation ticks on its own thread, this one draws, presents and polls input
+    //
 
-            // Draw cave
-            for( int row = 0; row < CAVE_HEIGHT; ++row )
-            {
-                for( int col = 0; col < CAVE_WIDTH; ++col )
-                {
-                    int x = PLAYFIELD_LEFT + col * CELL_SIZE - cameraX;
-                    int y = PLAYFIELD_TOP + row * CELL_SIZE - cameraY;
-
-                    if( cellCover[row][col] )
-                    {
-                        drawSprite( spriteSteelWall, 0, x, y, curColors.boulderFg, BLACK, turn );
-                    }
-                    else
-                    {
-                        switch( map[row][col] )
-                        {
-                        case OBJ_SPACE:
-                            if( spaceFlashingTurnsLeft > 0 && !isAddingTimeToScore
-                                    && turnsTillExitingCave == 0 )
-                            {
-                                drawSprite( spriteSpaceFlash, turn, x, y, WHITE, BLACK, 0 );
-                            }
-                            else
-                            {
-                                drawSprite( spriteSpace, 0, x, y, BLACK, BLACK, 0 );
-                            }
-                            break;
-
-                        case OBJ_STEEL_WALL:
-                        case OBJ_PRE_OUTBOX:
-                            drawSprite( spriteSteelWall, 0, x, y, curColors.boulderFg, BLACK, 0 );
-                            break;
-
-                        case OBJ_FLASHING_OUTBOX:
-                            if( turn % 2 == 0 )
-                            {
-                                drawSprite( spriteOutbox, 0, x, y, curColors.boulderFg, BLACK, 0 );
-                            }
-                            else
-                            {
-                                drawSprite( spriteSteelWall, 0, x, y, curColors.boulderFg, BLACK, 0 );
-                            }
-                            break;
-
-                        case OBJ_DIRT:
-                            drawSprite( spriteDirt, 0, x, y, curColors.dirtFg, BLACK, 0 );
-                            break;
-
-                        case OBJ_BRICK_WALL:
-                            drawSprite( spriteBrickWall, 0, x, y, curColors.brickWallFg,
-                                    curColors.brickWallBg, 0 );
-                            break;
-
-                        case OBJ_MAGIC_WALL:
-                        {
-                            int frame = (magicWallStatus == MAGIC_WALL_ON) ? turn : 0;
-                            drawSprite( spriteBrickWall, frame, x, y, curColors.brickWallFg,
-                                    curColors.brickWallBg, 0 );
-                            break;
-                        }
-
-                        case OBJ_BOULDER_STATIONARY:
-                        case OBJ_BOULDER_FALLING:
-                            drawSprite( spriteBoulder, 0, x, y, curColors.boulderFg, BLACK, 0 );
-                            break;
-
-                        case OBJ_DIAMOND_STATIONARY:
-                        case OBJ_DIAMOND_FALLING:
-                            drawSprite( spriteDiamond, turn, x, y, WHITE, BLACK, 0 );
-                            break;
-
-                        case OBJ_FIREFLY_LEFT:
-                        case OBJ_FIREFLY_UP:
-                        case OBJ_FIREFLY_RIGHT:
-                        case OBJ_FIREFLY_DOWN:
-                            drawSprite( spriteFirefly, turn, x, y, curColors.flyFg, curColors.flyBg, 0 );
-                            break;
-
-                        case OBJ_BUTTERFLY_LEFT:
-                        case OBJ_BUTTERFLY_UP:
-                        case OBJ_BUTTERFLY_RIGHT:
-                        case OBJ_BUTTERFLY_DOWN:
-                            drawSprite( spriteButterfly, turn, x, y, curColors.flyFg, curColors.flyBg, 0 );
-                            break;
-
-                            //
-                            // Draw Rockford birth
-                            //
-
-                        case OBJ_PRE_ROCKFORD_1:
-                            if( rockfordTurnsTillBirth > 0 )
-                            {
-                                if( rockfordTurnsTillBirth % 2 )
-                                {
-                                    drawSprite( spriteSteelWall, 0, x, y, curColors.boulderFg, BLACK, 0 );
-                                }
-                                else
-                                {
-                                    drawSprite( spriteOutbox, 0, x, y, curColors.boulderFg, BLACK, 0 );
-                                }
-                            }
-                            else
-                            {
-                                drawSprite( spriteExplosion, 0, x, y, WHITE, BLACK, 0 );
-                            }
-                            break;
-                        case OBJ_PRE_ROCKFORD_2:
-                            drawSprite( spriteExplosion, 1, x, y, WHITE, BLACK, 0 );
-                            break;
-                        case OBJ_PRE_ROCKFORD_3:
-                            drawSprite( spriteExplosion, 2, x, y, WHITE, BLACK, 0 );
-                            break;
-                        case OBJ_PRE_ROCKFORD_4:
-                            drawSprite( spriteRockfordRight, turn, x, y, GRAY, BLACK, 0 );
-                            break;
-
-                            //
-                            // Draw rockford
-                            //
-
-                        case OBJ_ROCKFORD:
-                            if( rockfordIsMoving )
-                            {
-                                if( rockfordIsFacingRight )
-                                {
-                                    drawSprite( spriteRockfordRight, tick, x, y, GRAY, BLACK, 0 );
-                                }
-                                else
-                                {
-                                    drawSprite( spriteRockfordLeft, tick, x, y, GRAY, BLACK, 0 );
-                                }
-                            }
-                            else if( rockfordIsBlinking && rockfordIsTapping )
-                            {
-                                drawSprite( spriteRockfordBlinkTap, tick, x, y, GRAY, BLACK, 0 );
-                            }
-                            else if( rockfordIsBlinking )
-                            {
-                                drawSprite( spriteRockfordBlink, tick, x, y, GRAY, BLACK, 0 );
-                            }
-                            else if( rockfordIsTapping )
-                            {
-                                drawSprite( spriteRockfordTap, tick, x, y, GRAY, BLACK, 0 );
-                            }
-                            else
-                            {
-                                drawSprite( spriteRockfordIdle, 0, x, y, GRAY, BLACK, 0 );
-                            }
-                            break;
-
-                            //
-                            // Draw explosion
-                            //
-
-                        case OBJ_EXPLODE_TO_SPACE_1:
-                        case OBJ_EXPLODE_TO_DIAMOND_1:
-                            drawSprite( spriteExplosion, 1, x, y, WHITE, BLACK, 0 );
-                            break;
-                        case OBJ_EXPLODE_TO_SPACE_2:
-                        case OBJ_EXPLODE_TO_DIAMOND_2:
-                            drawSprite( spriteExplosion, 2, x, y, WHITE, BLACK, 0 );
-                            break;
-                        case OBJ_EXPLODE_TO_SPACE_3:
-                        case OBJ_EXPLODE_TO_DIAMOND_3:
-                            drawSprite( spriteExplosion, 1, x, y, WHITE, BLACK, 0 );
-                            break;
-                        case OBJ_EXPLODE_TO_SPACE_4:
-                        case OBJ_EXPLODE_TO_DIAMOND_4:
-                            drawSprite( spriteExplosion, 0, x, y, WHITE, BLACK, 0 );
-                            break;
-
-                        case OBJ_AMOEBA:
-                            drawSprite( spriteAmoeba, turn, x, y, GREEN, BLACK, 0 );
-                            break;
-                        }
-                    }
-                }
-            }
+    // Sound stops after the simulation, which posts it
+    initializeSoundSystem( &soundSystem, 0.02f, simulation.tickDuration / 1e9f );
+    atexit( stopSound );
 
-            //
-            // Draw tile cover
-            //
+    startSimulation( &simulation );
+    atexit( stopSimulation );
+    startRenderThreads( (int) sysconf( _SC_NPROCESSORS_ONLN ) );
 
-            for( int row = 0; row < PLAYFIELD_HEIGHT_IN_TILES; ++row )
-            {
-                for( int col = 0; col < PLAYFIELD_WIDTH_IN_TILES; ++col )
-                {
-                    if( tileCover[row][col] )
-                    {
-                        int x = PLAYFIELD_LEFT + col * TILE_SIZE;
-                        int y = PLAYFIELD_TOP + row * TILE_SIZE;
-                        drawSprite( spriteSteelWallTile, 0, x, y, curColors.boulderFg, BLACK, turn );
-                    }
-                }
-            }
+    atexit( printMoveLatency );
+    signal( SIGUSR1, requestLatencyPrint );
 
-            //
-            // Draw status bar
-            //
+    // Frames are drawn at the display's refresh rate while something is part way through a turn
+    uint64_t displayFrameDuration = 1000000000 / frame_buffer_refresh_rate();
+    bool isMoving = false;
+    uint64_t nextFrameTime = 0;
+    uint64_t shownMoveInputTime = 0;
+    uint32_t presentedViewVersion = 0;
 
-            {
-                // Black background
-                drawFilledRect( VIEWPORT_LEFT, VIEWPORT_TOP, VIEWPORT_RIGHT, VIEWPORT_TOP + STATUS_BAR_HEIGHT,
-                        BLACK );
+    // The simulation stops itself on KEY_QUIT
+    while( atomic_load( &simulation.isRunning ) )
+    {
+        poll_controller();
 
-                int x = VIEWPORT_LEFT;
-                int y = VIEWPORT_TOP + TILE_SIZE;
+        // A frame only changes when the simulation publishes one that looks different, or with time
+        // while something is drawn part of the way through a turn
+        bool isNewFrame;
+        const Frame *frame = acquireFrame( &simulation.exchange, &isNewFrame );
 
-                for( int i = 0; statusBarText[i]; ++i )
-                {
-                    drawSprite( spriteAscii, statusBarText[i] - ' ', x + i * TILE_SIZE, y, GRAY, BLACK, 0 );
-                }
-            }
+        if( (isNewFrame && frame->viewVersion != presentedViewVersion) || isMoving )
+        {
+            // Interpolate through the turn by how long ago the latest tick was due
+            uint64_t now = timer_tick();
+            float tickFraction = (float) (int64_t) (now - frame->tickTime) / simulation.tickDuration;
+            tickFraction = tickFraction < 0.0f ? 0.0f : tickFraction < 1.0f ? tickFraction : 1.0f;
+            float alpha = ((frame->state.tick % TICKS_PER_TURN) + tickFraction) / TICKS_PER_TURN;
+            alpha = alpha < 1.0f ? alpha : 1.0f;
+            isMoving = renderGame( &frame->state, &frame->turnStartState, alpha,
+                    &caveColors[ frame->state.loadedCaveNumber ] );
 
-            //
-            // Camera debugging
-            //
+            // Display backbuffer
+            frame_buffer_switch(0);
+            nextFrameTime = now + displayFrameDuration;
+            presentedViewVersion = frame->viewVersion;
 
-            if( DEV_CAMERA_DEBUGGING )
+            if( frame->moveInputTime != shownMoveInputTime )
             {
-                drawRect( CAMERA_START_LEFT, 0, CAMERA_START_LEFT, BACKBUFFER_HEIGHT - 1, WHITE );
-                drawRect( CAMERA_STOP_LEFT, 0, CAMERA_STOP_LEFT, BACKBUFFER_HEIGHT - 1, WHITE );
-                drawRect( CAMERA_START_RIGHT, 0, CAMERA_START_RIGHT, BACKBUFFER_HEIGHT - 1, WHITE );
-                drawRect( CAMERA_STOP_RIGHT, 0, CAMERA_STOP_RIGHT, BACKBUFFER_HEIGHT - 1, WHITE );
-
-                drawRect( 0, CAMERA_START_TOP, BACKBUFFER_WIDTH - 1, CAMERA_START_TOP, WHITE );
-                drawRect( 0, CAMERA_STOP_TOP, BACKBUFFER_WIDTH - 1, CAMERA_STOP_TOP, WHITE );
-                drawRect( 0, CAMERA_START_BOTTOM, BACKBUFFER_WIDTH - 1, CAMERA_START_BOTTOM, WHITE );
-                drawRect( 0, CAMERA_STOP_BOTTOM, BACKBUFFER_WIDTH - 1, CAMERA_STOP_BOTTOM, WHITE );
-
-                drawRect( rockfordRectLeft, rockfordRectTop, rockfordRectRight, rockfordRectBottom, WHITE );
+                uint64_t presentTime = timer_tick();
+                latency_record( &moveLatency, presentTime - frame->moveInputTime );
+                latency_record( &pressToTickLatency, frame->moveTickTime - frame->moveInputTime );
+                latency_record( &tickToPresentLatency, presentTime - frame->moveTickTime );
+                shownMoveInputTime = frame->moveInputTime;
             }
+        }
 
-            // Display backbuffer
-            frame_buffer_switch(0);
-            poll_controller(0);
+        if( isLatencyPrintRequested )
+        {
+            isLatencyPrintRequested = 0;
+            printMoveLatency();
         }
+
+        // Sleep until the next display frame while something is moving, otherwise until the
+        // simulation publishes a frame that looks different. Input wakes it up either way.
+        wait_controller( isMoving ? nextFrameTime : 0 );
     }
 
     return 0;
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "game.h"
+#include "simulation.h"
+#include "replay.h"
+
+/*
+ * Cave size test: resizes cave A, plays it with pseudo-random input and
+ * checks the sentinel border stays intact, a cloned state steps the same
+ * as the original, and the game replays to the same final state.
+ *
+ *   cave-size-test
+ */
+
+#define TEST_TICKS 3000
+
+typedef struct
+{
+    int width;
+    int height;
+} CaveSize;
+
+const CaveSize testSizes[] =
+{
+    { 0, 0 },       // The original 40x22
+    { 16, 10 },
+    { 41, 22 },
+    { 40, 30 },
+    { 64, 30 },
+    { 65, 40 },
+    { 100, 60 },
+    { 255, 255 },
+};
+
+Input randomInput(uint32_t *random)
+{
+    *random = *random * 1664525 + 1013904223;
+    Input input = 0;
+    if( (*random >> 28) < 12 )
+    {
+        input |= KEY_BIT( KEY_RIGHT + (*random >> 24) % 4 );
+    }
+    if( (*random >> 20) % 8 == 0 )
+    {
+        input |= KEY_BIT( KEY_FIRE );
+    }
+    return input;
+}
+
+bool isBorderIntact(const GameState *state)
+{
+    for( int col = -1; col <= state->caveWidth; ++col )
+    {
+        if( state->map[CELL_INDEX( state, -1, col )] != OBJ_STEEL_WALL
+                || state->map[CELL_INDEX( state, state->caveHeight, col )] != OBJ_STEEL_WALL )
+        {
+            return false;
+        }
+    }
+    for( int row = 0; row < state->caveHeight; ++row )
+    {
+        if( state->map[CELL_INDEX( state, row, -1 )] != OBJ_STEEL_WALL
+                || state->map[CELL_INDEX( state, row, state->caveWidth )] != OBJ_STEEL_WALL )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool testCaveSize(CaveSize size)
+{
+    static GameState state, clone, replayed;
+    uint32_t seed = 12345 + size.width * 256 + size.height;
+    uint32_t random = seed;
+    int expectedWidth = size.width ? size.width : CAVE_WIDTH;
+    int expectedHeight = size.height ? size.height : CAVE_HEIGHT;
+    bool isOk = true;
+
+    setCaveSize( CAVE_A, size.width, size.height );
+    initGameState( &state, CAVE_A, 0, seed );
+
+    Replay replay;
+    initReplay( &replay, seed, CAVE_A, 0 );
+
+    for( int tick = 0; tick < TEST_TICKS && isOk; ++tick )
+    {
+        Input input = randomInput( &random );
+        recordReplayInput( &replay, input );
+        stepGame( &state, input );
+
+        // Halfway through, a clone takes over from the original
+        if( tick == TEST_TICKS / 2 )
+        {
+            cloneGameState( &clone, &state );
+        }
+        else if( tick > TEST_TICKS / 2 )
+        {
+            stepGame( &clone, input );
+            if( hashGameState( &clone ) != hashGameState( &state ) )
+            {
+                printf( "%dx%d: clone differs at tick %d\n", expectedWidth, expectedHeight, tick );
+                isOk = false;
+            }
+        }
+
+        if( state.loadedCaveNumber == CAVE_A
+                && (state.caveWidth != expectedWidth || state.caveHeight != expectedHeight) )
+        {
+            printf( "%dx%d: cave loaded as %dx%d\n", expectedWidth, expectedHeight, state.caveWidth,
+                    state.caveHeight );
+            isOk = false;
+        }
+        if( !isBorderIntact( &state ) )
+        {
+            printf( "%dx%d: border broken at tick %d\n", expectedWidth, expectedHeight, tick );
+            isOk = false;
+        }
+    }
+
+    finishReplay( &replay, &state );
+    if( isOk && !playReplay( &replay, &replayed ) )
+    {
+        printf( "%dx%d: replay does not match\n", expectedWidth, expectedHeight );
+        isOk = false;
+    }
+
+    printf( "%dx%d: %s, turn %d, score %d\n", expectedWidth, expectedHeight, isOk ? "OK" : "FAILED",
+            state.turn, state.score );
+
+    freeReplay( &replay );
+    freeGameState( &state );
+    freeGameState( &clone );
+    freeGameState( &replayed );
+    setCaveSize( CAVE_A, 0, 0 );
+    return isOk;
+}
+
+int main(int argc, char *argv[])
+{
+    int failures = 0;
+    int count = sizeof(testSizes) / sizeof(testSizes[0]);
+    for( int i = 0; i < count; ++i )
+    {
+        failures += !testCaveSize( testSizes[i] );
+    }
+
+    printf( "%d cave sizes, %d failed\n", count, failures );
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
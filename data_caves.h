@@ -1,6 +1,6 @@
 uint8_t caveA[] =
         { 0x01, 0x14, 0x0A, 0x0F, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x96, 0x6E,
-                0x46, 0x28, 0x1E, 0x08, 0x0B, 0x09, 0xD4, 0x20, 0x00, 0x10, 0x14, 0x00, 0x3C, 0x32, 0x09,
+                0x46, 0x28, 0x1E, 0x08, 0x0B, 0x09, 0x00, 0x00, 0x00, 0x10, 0x14, 0x00, 0x3C, 0x32, 0x09,
                 0x00, 0x42, 0x01, 0x09, 0x1E, 0x02, 0x42, 0x09, 0x10, 0x1E, 0x02, 0x25, 0x03, 0x04, 0x04,
                 0x26, 0x12, 0xFF, };
 
@@ -12,7 +12,7 @@ uint8_t caveB[] = { 0x02, 0x14, 0x14, 0x32, 0x03, 0x00, 0x01, 0x57, 0x58, 0x0A,
         0x12, 0x15, 0x04, 0x12, 0x16, 0xFF, };
 
 uint8_t caveC[] = { 0x03, 0x00, 0x0F, 0x00, 0x00, 0x32, 0x36, 0x34, 0x37, 0x18, 0x17, 0x18, 0x17, 0x15, 0x96,
-        0x64, 0x5A, 0x50, 0x46, 0x09, 0x08, 0x09, 0x04, 0x00, 0x02, 0x10, 0x14, 0x00, 0x64, 0x32, 0x09, 0x00,
+        0x64, 0x5A, 0x50, 0x46, 0x09, 0x08, 0x09, 0x00, 0x00, 0x02, 0x10, 0x14, 0x00, 0x64, 0x32, 0x09, 0x00,
         0x25, 0x03, 0x04, 0x04, 0x27, 0x14, 0xFF, };
 
 uint8_t caveD[] = { 0x04, 0x14, 0x05, 0x14, 0x00, 0x6E, 0x70, 0x73, 0x77, 0x24, 0x24, 0x24, 0x24, 0x24, 0x78,
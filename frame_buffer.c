@@ -2,40 +2,125 @@
 #include <stdbool.h>
 #include <SDL2/SDL.h>
 #include "game.h"
+#include "input.h"
+#include "util.h"
 #include <string.h>
 #include <assert.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Frames are expanded straight into the locked memory of a streaming
+ * texture in the window's own pixel format, which is copied without
+ * blending. Set to 0 for the old path, which expands into tft_fb and
+ * uploads that to a static BGRA texture drawn with blending on, to
+ * compare the two with DEV_PRESENT_TIMING.
+ */
+#ifndef FRAME_BUFFER_STREAMING
+#define FRAME_BUFFER_STREAMING 1
+#endif
+
+#define PRESENT_TIMING_FRAMES 300
+
 typedef struct
 {
     SDL_Window *window;
     SDL_Renderer *renderer;
     SDL_Texture *texture;
+    uint32_t palette[COLOR_COUNT];  /* In the texture's pixel format */
+    uint8_t index_fb[BACKBUFFER_HEIGHT][BACKBUFFER_WIDTH];
+#if !FRAME_BUFFER_STREAMING
     uint32_t tft_fb[BACKBUFFER_HEIGHT][BACKBUFFER_WIDTH];
+#endif
+    uint64_t present_time;
+    int present_frames;
 } monitor_t;
 
 static monitor_t monitor = { 0 };
 monitor_t *m = &monitor;
 
-int quit_filter(void *userdata, SDL_Event *event)
+/*
+ * Palette expansion: turns the Color indices the game draws into the
+ * 32-bit pixels of the texture, once per presented frame. The SSSE3
+ * version looks up 16 pixels at a time, one pshufb per byte of the
+ * palette entries, and interleaves the four results into pixels. The
+ * version is picked on first use.
+ */
+
+typedef void (*expand_palette_func)(const uint8_t *src, uint32_t *dst, int count, const uint32_t *palette);
+
+static void expand_palette_scalar(const uint8_t *src, uint32_t *dst, int count, const uint32_t *palette)
+{
+    for( int i = 0; i < count; ++i )
+    {
+        dst[i] = palette[src[i]];
+    }
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("ssse3")))
+static void expand_palette_ssse3(const uint8_t *src, uint32_t *dst, int count, const uint32_t *palette)
 {
-    (void) userdata;
+    uint8_t lut[4][16] = { { 0 } };
 
-    if( SDL_WINDOWEVENT == event->type )
+    for( int color = 0; color < COLOR_COUNT; ++color )
     {
-        if( SDL_WINDOWEVENT_CLOSE == event->window.event )
+        for( int byte = 0; byte < 4; ++byte )
         {
-            exit( 0 );
+            lut[byte][color] = (uint8_t) (palette[color] >> (byte * 8));
         }
     }
-    else if( SDL_QUIT == event->type )
+
+    __m128i lut0 = _mm_loadu_si128( (const __m128i*) lut[0] );
+    __m128i lut1 = _mm_loadu_si128( (const __m128i*) lut[1] );
+    __m128i lut2 = _mm_loadu_si128( (const __m128i*) lut[2] );
+    __m128i lut3 = _mm_loadu_si128( (const __m128i*) lut[3] );
+
+    int i = 0;
+    for( ; i + 16 <= count; i += 16 )
     {
-        exit( 0 );
+        __m128i indices = _mm_loadu_si128( (const __m128i*) (src + i) );
+        __m128i byte0 = _mm_shuffle_epi8( lut0, indices );
+        __m128i byte1 = _mm_shuffle_epi8( lut1, indices );
+        __m128i byte2 = _mm_shuffle_epi8( lut2, indices );
+        __m128i byte3 = _mm_shuffle_epi8( lut3, indices );
+
+        __m128i low01 = _mm_unpacklo_epi8( byte0, byte1 );
+        __m128i high01 = _mm_unpackhi_epi8( byte0, byte1 );
+        __m128i low23 = _mm_unpacklo_epi8( byte2, byte3 );
+        __m128i high23 = _mm_unpackhi_epi8( byte2, byte3 );
+
+        _mm_storeu_si128( (__m128i*) (dst + i), _mm_unpacklo_epi16( low01, low23 ) );
+        _mm_storeu_si128( (__m128i*) (dst + i + 4), _mm_unpackhi_epi16( low01, low23 ) );
+        _mm_storeu_si128( (__m128i*) (dst + i + 8), _mm_unpacklo_epi16( high01, high23 ) );
+        _mm_storeu_si128( (__m128i*) (dst + i + 12), _mm_unpackhi_epi16( high01, high23 ) );
     }
 
-    return 1;
+    expand_palette_scalar( src + i, dst + i, count - i, palette );
+}
+
+#endif
+
+static void expand_palette_select(const uint8_t *src, uint32_t *dst, int count, const uint32_t *palette);
+
+static expand_palette_func expand_palette = expand_palette_select;
+
+static void expand_palette_select(const uint8_t *src, uint32_t *dst, int count, const uint32_t *palette)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    expand_palette = __builtin_cpu_supports( "ssse3" ) ? expand_palette_ssse3 : expand_palette_scalar;
+#else
+    expand_palette = expand_palette_scalar;
+#endif
+
+    expand_palette( src, dst, count, palette );
 }
 
-volatile uint32_t* frame_buffer_init(void)
+volatile uint8_t* frame_buffer_init(const RGBQUAD palette[COLOR_COUNT])
 {
     /* Initialise the SDL*/
     if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
@@ -44,8 +129,6 @@ volatile uint32_t* frame_buffer_init(void)
         exit( -1 );
     }
 
-    SDL_SetEventFilter( quit_filter, NULL );
-
     m->window = SDL_CreateWindow( "Boulder Dash", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
                                   BACKBUFFER_WIDTH * 3, BACKBUFFER_HEIGHT * 3, 0 );
     assert( m->window );
@@ -53,23 +136,71 @@ volatile uint32_t* frame_buffer_init(void)
     m->renderer = SDL_CreateRenderer( m->window, -1, SDL_RENDERER_SOFTWARE );
     assert( m->renderer );
 
-    m->texture = SDL_CreateTexture( m->renderer, SDL_PIXELFORMAT_BGRA8888, SDL_TEXTUREACCESS_STATIC,
+#if FRAME_BUFFER_STREAMING
+    uint32_t format = SDL_GetWindowPixelFormat( m->window );
+    if( SDL_BYTESPERPIXEL( format ) != 4 || SDL_ISPIXELFORMAT_INDEXED( format )
+            || SDL_ISPIXELFORMAT_FOURCC( format ) )
+    {
+        format = SDL_PIXELFORMAT_ARGB8888;
+    }
+
+    m->texture = SDL_CreateTexture( m->renderer, format, SDL_TEXTUREACCESS_STREAMING,
+                                    BACKBUFFER_WIDTH, BACKBUFFER_HEIGHT );
+    assert( m->texture );
+
+    SDL_SetTextureBlendMode( m->texture, SDL_BLENDMODE_NONE );
+#else
+    uint32_t format = SDL_PIXELFORMAT_BGRA8888;
+
+    m->texture = SDL_CreateTexture( m->renderer, format, SDL_TEXTUREACCESS_STATIC,
                                     BACKBUFFER_WIDTH, BACKBUFFER_HEIGHT );
     assert( m->texture );
 
     SDL_SetTextureBlendMode( m->texture, SDL_BLENDMODE_BLEND );
+#endif
 
-    return (void*) m->tft_fb;
+    /* The game's palette entries hold blue, green, red and alpha from the top byte down */
+    SDL_PixelFormat *pixel_format = SDL_AllocFormat( format );
+    assert( pixel_format );
+    for( int i = 0; i < COLOR_COUNT; ++i )
+    {
+        m->palette[i] = SDL_MapRGBA( pixel_format, (palette[i] >> 8) & 0xFF, (palette[i] >> 16) & 0xFF,
+                                     palette[i] >> 24, palette[i] & 0xFF );
+    }
+    SDL_FreeFormat( pixel_format );
+
+    return (void*) m->index_fb;
 }
 
 int frame_buffer_switch(int offset)
 {
     (void) offset;
 
+    uint64_t start = timer_tick();
+
+#if FRAME_BUFFER_STREAMING
+    void *pixels;
+    int pitch;
+    int rslt = SDL_LockTexture( m->texture, NULL, &pixels, &pitch );
+    assert( 0 == rslt );
+
+    for( int y = 0; y < BACKBUFFER_HEIGHT; ++y )
+    {
+        uint32_t *row = (uint32_t*) ((uint8_t*) pixels + y * pitch);
+        expand_palette( m->index_fb[y], row, BACKBUFFER_WIDTH, m->palette );
+    }
+
+    SDL_UnlockTexture( m->texture );
+
+    /* The texture is opaque and covers the whole window, so there is nothing to clear */
+#else
+    expand_palette( &m->index_fb[0][0], &m->tft_fb[0][0], BACKBUFFER_WIDTH * BACKBUFFER_HEIGHT, m->palette );
+
     int rslt = SDL_UpdateTexture( m->texture, NULL, m->tft_fb, BACKBUFFER_WIDTH * sizeof(uint32_t) );
     assert( 0 == rslt );
     rslt = SDL_RenderClear( m->renderer );
     assert( 0 == rslt );
+#endif
 
     /* Update the renderer with the texture containing the rendered image */
     rslt = SDL_RenderCopy( m->renderer, m->texture, NULL, NULL );
@@ -77,74 +208,139 @@ int frame_buffer_switch(int offset)
 
     SDL_RenderPresent( m->renderer );
 
+    if( DEV_PRESENT_TIMING )
+    {
+        m->present_time += timer_get_relative( start );
+        if( ++m->present_frames == PRESENT_TIMING_FRAMES )
+        {
+            printf( "present: %.1f us/frame (%s)\n", (double) m->present_time / 1e3 / m->present_frames,
+                    FRAME_BUFFER_STREAMING ? "streaming" : "static" );
+            m->present_time = 0;
+            m->present_frames = 0;
+        }
+    }
+
     return 0;
 }
 
-bool keyPressed = false;
-uint8_t keyVal = 0;
-uint8_t poll_controller(uint8_t virtKey)
+/* Refresh rate in Hz of the display the window is on, 60 when SDL does not know it */
+int frame_buffer_refresh_rate(void)
+{
+    SDL_DisplayMode mode;
+    int display = SDL_GetWindowDisplayIndex( m->window );
+
+    if( display < 0 || SDL_GetCurrentDisplayMode( display, &mode ) != 0 || mode.refresh_rate <= 0 )
+    {
+        return 60;
+    }
+    return mode.refresh_rate;
+}
+
+/* Returns the game key for an SDL key, or -1 */
+static int map_key(SDL_Keycode sym)
+{
+    switch( sym )
+    {
+    case SDLK_SPACE:
+        return KEY_FIRE;
+
+    case SDLK_KP_0:
+    case SDLK_0:
+        return KEY_ZERO;
+
+    case SDLK_RIGHT:
+    case SDLK_KP_PLUS:
+        return KEY_RIGHT;
+
+    case SDLK_LEFT:
+    case SDLK_KP_MINUS:
+        return KEY_LEFT;
+
+    case SDLK_UP:
+        return KEY_UP;
+
+    case SDLK_DOWN:
+        return KEY_DOWN;
+
+    case SDLK_RETURN2:
+    case SDLK_RETURN:
+        return KEY_FAIL;
+
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Queues every key press and release for the simulation, stamped with when
+ * SDL received it. SDL stamps events in milliseconds since SDL_Init, so the
+ * age of each event is taken off the current timer_tick(). Escape and
+ * closing the window queue KEY_QUIT.
+ */
+/*
+ * Converts an SDL event timestamp, in milliseconds on SDL_GetTicks(), to
+ * timer_tick() time, given both clocks read at the same moment
+ */
+static uint64_t get_event_time(Uint32 timestamp, uint64_t now, Uint32 nowTicks)
+{
+    // An event stamped after nowTicks arrived since it was read
+    int32_t age = (int32_t) (nowTicks - timestamp);
+    age = age > 0 ? age : 0;
+    return now - (uint64_t) age * 1000000;
+}
+
+void poll_controller(void)
 {
-    (void)virtKey;
     SDL_Event event;
+    uint64_t now = timer_tick();
+    Uint32 nowTicks = SDL_GetTicks();
 
     while( SDL_PollEvent( &event ) )
     {
-        switch( event.type )
+        if( SDL_QUIT == event.type )
+        {
+            InputEvent input = { get_event_time( event.quit.timestamp, now, nowTicks ), KEY_QUIT, true };
+            pushInputEvent( &inputQueue, &input );
+        }
+
+        if( (SDL_KEYDOWN == event.type && !event.key.repeat) || SDL_KEYUP == event.type )
         {
-        case SDL_KEYDOWN:
-            keyPressed = 1;
-            switch( event.key.keysym.sym )
+            int key = SDLK_ESCAPE == event.key.keysym.sym ? KEY_QUIT : map_key( event.key.keysym.sym );
+            if( key >= 0 )
             {
-            case SDLK_SPACE :
-                keyVal = KEY_FIRE;
-                break;
-
-            case SDLK_KP_0 :
-            case SDLK_0 :
-                keyVal = KEY_ZERO;
-                break;
-
-            case SDLK_RIGHT:
-            case SDLK_KP_PLUS:
-                keyVal = KEY_RIGHT;
-                break;
-
-            case SDLK_LEFT:
-            case SDLK_KP_MINUS:
-                keyVal = KEY_LEFT;
-                break;
-
-            case SDLK_UP:
-                keyVal = KEY_UP;
-                break;
-
-            case SDLK_DOWN:
-                keyVal = KEY_DOWN;
-                break;
-
-            case SDLK_RETURN2 :
-            case SDLK_RETURN :
-                keyVal = KEY_FAIL;
-                break;
-
-            case SDLK_ESCAPE:
-                exit( 1 );
-                break;
+                InputEvent input = { get_event_time( event.key.timestamp, now, nowTicks ), key,
+                        SDL_KEYDOWN == event.type };
+                pushInputEvent( &inputQueue, &input );
             }
-            break;
-
-        case SDL_KEYUP:
-            keyPressed = 0;
-            keyVal = 0;
-            break;
+        }
+    }
+}
 
-        default:
-            break;
+/*
+ * Blocks until an event arrives, wake_controller is called or timer_tick()
+ * reaches the deadline, whichever comes first. A zero deadline waits for
+ * an event or a wake only. The events are left for poll_controller.
+ */
+void wait_controller(uint64_t deadline)
+{
+    int timeout = -1;
 
+    if( deadline )
+    {
+        uint64_t now = timer_tick();
+        if( now >= deadline )
+        {
+            return;
         }
+        timeout = (int) ((deadline - now + 999999) / 1000000);
     }
 
-    SDL_Delay( 5 ); /* Sleep for 5 millisecond */
+    SDL_WaitEventTimeout( NULL, timeout );
+}
 
-    return keyVal;
+/* Safe to call from any thread */
+void wake_controller(void)
+{
+    SDL_Event event = { .type = SDL_USEREVENT };
+    SDL_PushEvent( &event );
 }
@@ -0,0 +1,69 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "game.h"
+#include "sound.h"
+#include "util.h"
+
+/*
+ * Null frame buffer, input and sound backend for the headless build.
+ * Nothing is ever displayed or heard and no input ever arrives, so
+ * the simulation runs as fast as the CPU allows.
+ */
+
+static uint8_t null_fb[BACKBUFFER_HEIGHT][BACKBUFFER_WIDTH];
+
+volatile uint8_t* frame_buffer_init(const RGBQUAD palette[COLOR_COUNT])
+{
+    (void) palette;
+
+    return (void*) null_fb;
+}
+
+int frame_buffer_switch(int offset)
+{
+    (void) offset;
+
+    return 0;
+}
+
+int frame_buffer_refresh_rate(void)
+{
+    return 60;
+}
+
+void poll_controller(void)
+{
+}
+
+void wait_controller(uint64_t deadline)
+{
+    if( deadline )
+    {
+        timer_sleep_until( deadline );
+    }
+}
+
+void wake_controller(void)
+{
+}
+
+bool initializeSoundSystem(SoundSystem *sys, float bufferDurationSec, float tickDuration)
+{
+    (void) bufferDurationSec;
+    (void) tickDuration;
+
+    sys->device = 0;
+    return false;
+}
+
+void postSound(SoundSystem *sys, SoundID soundId, uint64_t dueTime)
+{
+    (void) sys;
+    (void) soundId;
+    (void) dueTime;
+}
+
+void closeSoundSystem(SoundSystem *sys)
+{
+    (void) sys;
+}
@@ -12,6 +12,13 @@ typedef uint32_t RGBQUAD;
 #define DEV_SLOW_TICK_DURATION 0
 #define DEV_QUICK_OUT_OF_TIME 0
 #define DEV_SINGLE_LIFE 0
+#define DEV_PRESENT_TIMING 0
+
+// Build options
+#ifndef HEADLESS
+#define HEADLESS 0  // No rendering, no clock: run turns as fast as possible
+#endif
+#define HEADLESS_DEFAULT_TURNS 100000
 
 // Gameplay constants
 #define START_CAVE CAVE_A
@@ -70,15 +77,16 @@ typedef uint32_t RGBQUAD;
 
 #define CAMERA_X_MIN 0
 #define CAMERA_Y_MIN 0
-#define CAMERA_X_MAX (CAVE_WIDTH*CELL_SIZE - PLAYFIELD_WIDTH)
-#define CAMERA_Y_MAX (CAVE_HEIGHT*CELL_SIZE - PLAYFIELD_HEIGHT)
+#define CAMERA_X_MAX(caveWidth) ((caveWidth)*CELL_SIZE - PLAYFIELD_WIDTH)
+#define CAMERA_Y_MAX(caveHeight) ((caveHeight)*CELL_SIZE - PLAYFIELD_HEIGHT)
 
 #define CAMERA_STEP TILE_SIZE
 
-// Backbuffer has 4 bits per pixel
+// Backbuffer has 8 bits per pixel, each a Color index. The frame buffer
+// backend looks the indices up in the palette when it presents a frame.
 #define BACKBUFFER_WIDTH (VIEWPORT_WIDTH + BORDER_SIZE*2)
 #define BACKBUFFER_HEIGHT (VIEWPORT_HEIGHT + BORDER_SIZE*2)
-#define BACKBUFFER_BYTES (BACKBUFFER_WIDTH*BACKBUFFER_HEIGHT/2)
+#define BACKBUFFER_BYTES (BACKBUFFER_WIDTH*BACKBUFFER_HEIGHT)
 
 // Keys
 typedef enum
@@ -94,15 +102,22 @@ typedef enum
 
 } KEYS;
 
-uint8_t poll_controller(uint8_t virtKey);
+// Input for one tick is a bitmask of the keys held down
+typedef uint8_t Input;
+#define KEY_BIT(key) ((Input) (1 << (key)))
+
+void poll_controller(void);
+void wait_controller(uint64_t deadline);
+void wake_controller(void);
 
 typedef enum
 {
     BLACK, GRAY, WHITE, RED, YELLOW, GREEN, BLUE, PURPLE, CYAN, COLOR_COUNT
 } Color;
 
-volatile uint32_t* frame_buffer_init(void);
+volatile uint8_t* frame_buffer_init(const RGBQUAD palette[COLOR_COUNT]);
 int frame_buffer_switch(int offset);
+int frame_buffer_refresh_rate(void);
 
 
 #endif /* GAME_H_ */
@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "game.h"
+#include "input.h"
+
+InputQueue inputQueue;
+
+// Returns false, dropping the event, when the queue is full
+bool pushInputEvent(InputQueue *queue, const InputEvent *event)
+{
+    unsigned head = atomic_load_explicit( &queue->head, memory_order_relaxed );
+    unsigned tail = atomic_load_explicit( &queue->tail, memory_order_acquire );
+
+    if( head - tail == INPUT_QUEUE_SIZE )
+    {
+        return false;
+    }
+
+    queue->events[ head & (INPUT_QUEUE_SIZE - 1) ] = *event;
+    atomic_store_explicit( &queue->head, head + 1, memory_order_release );
+    return true;
+}
+
+// Takes the oldest event if it happened before the given time
+bool popInputEvent(InputQueue *queue, uint64_t before, InputEvent *event)
+{
+    unsigned tail = atomic_load_explicit( &queue->tail, memory_order_relaxed );
+    unsigned head = atomic_load_explicit( &queue->head, memory_order_acquire );
+
+    if( head == tail || queue->events[ tail & (INPUT_QUEUE_SIZE - 1) ].time >= before )
+    {
+        return false;
+    }
+
+    *event = queue->events[ tail & (INPUT_QUEUE_SIZE - 1) ];
+    atomic_store_explicit( &queue->tail, tail + 1, memory_order_release );
+    return true;
+}
+
+// Applies the events that happened before the given time
+void updateInputState(InputState *input, InputQueue *queue, uint64_t before)
+{
+    InputEvent event;
+
+    while( popInputEvent( queue, before, &event ) )
+    {
+        if( event.isDown )
+        {
+            if( !(input->pressed & KEY_BIT( event.key )) )
+            {
+                input->pressTime[ event.key ] = event.time;
+            }
+            input->held |= KEY_BIT( event.key );
+            input->pressed |= KEY_BIT( event.key );
+        }
+        else
+        {
+            input->held &= ~KEY_BIT( event.key );
+        }
+    }
+    input->sampleTime = before;
+}
+
+Input sampleInput(const InputState *input)
+{
+    return input->held | input->pressed;
+}
+
+// Returns when the input on the given keys was taken: the first press among them since the last
+// turn, else the latest sample if one is held down from before, else 0
+uint64_t getInputTime(const InputState *input, Input keys)
+{
+    uint64_t first = 0;
+
+    for( int key = 0; key < 8; ++key )
+    {
+        if( (input->pressed & keys & KEY_BIT( key )) && (!first || input->pressTime[ key ] < first) )
+        {
+            first = input->pressTime[ key ];
+        }
+    }
+    return first || !(input->held & keys) ? first : input->sampleTime;
+}
+
+// Forgets the presses once a turn has acted on them
+void endInputTurn(InputState *input)
+{
+    input->pressed = 0;
+}
@@ -0,0 +1,57 @@
+#ifndef INPUT_H_
+#define INPUT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "game.h"
+#include "simulation.h"
+
+//
+// Input
+//
+// The frame buffer backend pushes every key press and release, stamped
+// on the timer_tick() clock with when it happened, into a lock-free
+// single producer, single consumer ring. The simulation drains it before
+// each tick into the keys held down plus the keys pressed since the last
+// turn. The game sees both until the turn has been taken, so a tap
+// shorter than a turn still counts.
+//
+
+#define INPUT_QUEUE_SIZE 256    // Power of two
+
+typedef struct
+{
+    uint64_t time;
+    uint8_t key;        // KEYS
+    bool isDown;
+} InputEvent;
+
+typedef struct
+{
+    InputEvent events[ INPUT_QUEUE_SIZE ];
+    alignas(CACHE_LINE_SIZE) atomic_uint head;  // Written by the producer only
+    alignas(CACHE_LINE_SIZE) atomic_uint tail;  // Written by the consumer only
+} InputQueue;
+
+typedef struct
+{
+    Input held;
+    Input pressed;                  // Since the last turn
+    uint64_t pressTime[ 8 ];        // Of each key's first press since the last turn
+    uint64_t sampleTime;            // Events before this time have been applied
+} InputState;
+
+extern InputQueue inputQueue;
+
+bool pushInputEvent(InputQueue *queue, const InputEvent *event);
+bool popInputEvent(InputQueue *queue, uint64_t before, InputEvent *event);
+
+void updateInputState(InputState *input, InputQueue *queue, uint64_t before);
+Input sampleInput(const InputState *input);
+uint64_t getInputTime(const InputState *input, Input keys);
+void endInputTurn(InputState *input);
+
+#endif /* INPUT_H_ */
@@ -0,0 +1,184 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "game.h"
+#include "simulation.h"
+#include "replay.h"
+
+// File layout, all integers little-endian:
+//   "BDRP", version, start cave, difficulty level, reserved,
+//   seed (u32), tick count (u32), final state hash (u64), run count (u32),
+//   run count * (input, length - 1)
+#define REPLAY_MAGIC "BDRP"
+#define REPLAY_VERSION 1
+#define REPLAY_HEADER_SIZE 28
+
+static void putU32(uint8_t *dst, uint32_t value)
+{
+    for( int i = 0; i < 4; ++i )
+    {
+        dst[i] = (value >> (i * 8)) & 0xFF;
+    }
+}
+
+static uint32_t getU32(const uint8_t *src)
+{
+    uint32_t value = 0;
+    for( int i = 0; i < 4; ++i )
+    {
+        value |= (uint32_t) src[i] << (i * 8);
+    }
+    return value;
+}
+
+void initReplay(Replay *replay, uint32_t seed, int startCave, int difficultyLevel)
+{
+    memset( replay, 0, sizeof(*replay) );
+
+    replay->seed = seed;
+    replay->startCave = startCave;
+    replay->difficultyLevel = difficultyLevel;
+}
+
+void freeReplay(Replay *replay)
+{
+    free( replay->runs );
+    replay->runs = NULL;
+    replay->runCount = 0;
+    replay->runCapacity = 0;
+}
+
+void recordReplayInput(Replay *replay, Input input)
+{
+    ++replay->tickCount;
+
+    if( replay->runCount > 0 )
+    {
+        ReplayRun *last = &replay->runs[replay->runCount - 1];
+        if( last->input == input && last->lengthMinusOne < REPLAY_MAX_RUN_LENGTH - 1 )
+        {
+            ++last->lengthMinusOne;
+            return;
+        }
+    }
+
+    if( replay->runCount == replay->runCapacity )
+    {
+        replay->runCapacity = replay->runCapacity ? replay->runCapacity * 2 : 1024;
+        replay->runs = realloc( replay->runs, replay->runCapacity * sizeof(*replay->runs) );
+        assert( replay->runs );
+    }
+
+    replay->runs[replay->runCount].input = input;
+    replay->runs[replay->runCount].lengthMinusOne = 0;
+    ++replay->runCount;
+}
+
+void finishReplay(Replay *replay, const GameState *state)
+{
+    replay->finalStateHash = hashGameState( state );
+}
+
+bool saveReplay(const Replay *replay, const char *path)
+{
+    FILE *file = fopen( path, "wb" );
+    if( !file )
+    {
+        return false;
+    }
+
+    uint8_t header[REPLAY_HEADER_SIZE];
+    memcpy( header, REPLAY_MAGIC, 4 );
+    header[4] = REPLAY_VERSION;
+    header[5] = replay->startCave;
+    header[6] = replay->difficultyLevel;
+    header[7] = 0;
+    putU32( header + 8, replay->seed );
+    putU32( header + 12, replay->tickCount );
+    putU32( header + 16, (uint32_t) replay->finalStateHash );
+    putU32( header + 20, (uint32_t) (replay->finalStateHash >> 32) );
+    putU32( header + 24, replay->runCount );
+
+    _Static_assert( sizeof(ReplayRun) == 2, "runs are written as they are stored" );
+
+    bool ok = fwrite( header, sizeof(header), 1, file ) == 1;
+    if( ok && replay->runCount > 0 )
+    {
+        ok = fwrite( replay->runs, sizeof(*replay->runs), replay->runCount, file ) == replay->runCount;
+    }
+
+    return fclose( file ) == 0 && ok;
+}
+
+bool loadReplay(Replay *replay, const char *path)
+{
+    memset( replay, 0, sizeof(*replay) );
+
+    FILE *file = fopen( path, "rb" );
+    if( !file )
+    {
+        return false;
+    }
+
+    uint8_t header[REPLAY_HEADER_SIZE];
+    bool ok = fread( header, sizeof(header), 1, file ) == 1 && memcmp( header, REPLAY_MAGIC, 4 ) == 0
+            && header[4] == REPLAY_VERSION && header[5] < CAVE_COUNT && header[6] < NUM_DIFFICULTY_LEVELS;
+
+    if( ok )
+    {
+        replay->startCave = header[5];
+        replay->difficultyLevel = header[6];
+        replay->seed = getU32( header + 8 );
+        replay->tickCount = getU32( header + 12 );
+        replay->finalStateHash = getU32( header + 16 ) | (uint64_t) getU32( header + 20 ) << 32;
+        replay->runCount = getU32( header + 24 );
+        replay->runCapacity = replay->runCount;
+
+        if( replay->runCount > 0 )
+        {
+            replay->runs = malloc( replay->runCount * sizeof(*replay->runs) );
+            ok = replay->runs
+                    && fread( replay->runs, sizeof(*replay->runs), replay->runCount, file ) == replay->runCount;
+        }
+
+        uint32_t tickCount = 0;
+        for( uint32_t i = 0; ok && i < replay->runCount; ++i )
+        {
+            tickCount += replay->runs[i].lengthMinusOne + 1;
+        }
+        ok = ok && tickCount == replay->tickCount;
+    }
+
+    fclose( file );
+
+    if( !ok )
+    {
+        freeReplay( replay );
+    }
+    return ok;
+}
+
+void startReplay(const Replay *replay, GameState *state)
+{
+    initGameState( state, replay->startCave, replay->difficultyLevel, replay->seed );
+}
+
+bool playReplay(const Replay *replay, GameState *state)
+{
+    startReplay( replay, state );
+
+    for( uint32_t i = 0; i < replay->runCount; ++i )
+    {
+        Input input = replay->runs[i].input;
+        for( int tick = 0; tick <= replay->runs[i].lengthMinusOne; ++tick )
+        {
+            stepGame( state, input );
+        }
+    }
+
+    return hashGameState( state ) == replay->finalStateHash;
+}
@@ -0,0 +1,52 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "game.h"
+#include "simulation.h"
+
+//
+// Replay
+//
+// A recorded game is its seed, start cave and difficulty level plus the
+// input of every tick, run-length encoded as (input, length - 1) byte
+// pairs. The hash of the final state lets playback verify that the
+// simulation still produces the same game.
+//
+
+#define REPLAY_MAX_RUN_LENGTH 256
+
+typedef struct
+{
+    Input input;
+    uint8_t lengthMinusOne;
+} ReplayRun;
+
+typedef struct
+{
+    uint32_t seed;
+    uint8_t startCave;
+    uint8_t difficultyLevel;
+    uint32_t tickCount;
+    uint64_t finalStateHash;
+
+    ReplayRun *runs;
+    uint32_t runCount;
+    uint32_t runCapacity;
+} Replay;
+
+void initReplay(Replay *replay, uint32_t seed, int startCave, int difficultyLevel);
+void freeReplay(Replay *replay);
+void recordReplayInput(Replay *replay, Input input);
+void finishReplay(Replay *replay, const GameState *state);
+
+bool saveReplay(const Replay *replay, const char *path);
+bool loadReplay(Replay *replay, const char *path);
+
+void startReplay(const Replay *replay, GameState *state);
+bool playReplay(const Replay *replay, GameState *state);
+
+#endif /* REPLAY_H_ */
@@ -0,0 +1,1518 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "data_caves.h"
+#include "game.h"
+#include "simulation.h"
+
+#define ARRAY_LENGTH(array) (sizeof(array)/sizeof(*array))
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+typedef enum
+{
+    OBJST_SINGLE, OBJST_LINE, OBJST_FILLED_RECT, OBJST_RECT,
+} ObjectStructure;
+
+typedef enum
+{
+    UP, DOWN, LEFT, RIGHT, DIRECTION_COUNT
+} Direction;
+typedef enum
+{
+    TURN_LEFT, STRAIGHT_AHEAD, TURN_RIGHT, TURNING_COUNT
+} Turning;
+
+typedef enum
+{
+    PROP_ACTIVE = 1 << 0,           // Acted on by the cave scan
+    PROP_ROUND = 1 << 1,            // Boulders and diamonds roll off it
+    PROP_EXPLOSIVE = 1 << 2,        // Explodes when hit by a falling boulder or diamond
+    PROP_EXPLODES_TO_DIAMONDS = 1 << 3,
+    PROP_KILLS_FLY = 1 << 4,        // Flies explode when next to it
+    PROP_FLY = 1 << 5,
+} ObjectProperty;
+
+#define OBJECT_COUNT (2 * OBJ_SCANNED)
+
+// Indexed by the full cell value, scanned flag included
+static const uint8_t objectProperties[ OBJECT_COUNT ] =
+{
+    [ OBJ_BRICK_WALL ] = PROP_ROUND,
+    [ OBJ_PRE_OUTBOX ] = PROP_ACTIVE,
+    [ OBJ_FIREFLY_LEFT ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_FLY,
+    [ OBJ_FIREFLY_UP ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_FLY,
+    [ OBJ_FIREFLY_RIGHT ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_FLY,
+    [ OBJ_FIREFLY_DOWN ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_FLY,
+    [ OBJ_FIREFLY_LEFT_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_FIREFLY_UP_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_FIREFLY_RIGHT_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_FIREFLY_DOWN_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_BOULDER_STATIONARY ] = PROP_ACTIVE | PROP_ROUND,
+    [ OBJ_BOULDER_STATIONARY_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_BOULDER_FALLING ] = PROP_ACTIVE,
+    [ OBJ_BOULDER_FALLING_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_DIAMOND_STATIONARY ] = PROP_ACTIVE | PROP_ROUND,
+    [ OBJ_DIAMOND_STATIONARY_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_DIAMOND_FALLING ] = PROP_ACTIVE,
+    [ OBJ_DIAMOND_FALLING_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_SPACE_0 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_SPACE_1 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_SPACE_2 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_SPACE_3 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_SPACE_4 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_DIAMOND_0 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_DIAMOND_1 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_DIAMOND_2 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_DIAMOND_3 ] = PROP_ACTIVE,
+    [ OBJ_EXPLODE_TO_DIAMOND_4 ] = PROP_ACTIVE,
+    [ OBJ_PRE_ROCKFORD_1 ] = PROP_ACTIVE,
+    [ OBJ_PRE_ROCKFORD_2 ] = PROP_ACTIVE,
+    [ OBJ_PRE_ROCKFORD_3 ] = PROP_ACTIVE,
+    [ OBJ_PRE_ROCKFORD_4 ] = PROP_ACTIVE,
+    [ OBJ_BUTTERFLY_DOWN ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_EXPLODES_TO_DIAMONDS | PROP_FLY,
+    [ OBJ_BUTTERFLY_LEFT ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_EXPLODES_TO_DIAMONDS | PROP_FLY,
+    [ OBJ_BUTTERFLY_UP ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_EXPLODES_TO_DIAMONDS | PROP_FLY,
+    [ OBJ_BUTTERFLY_RIGHT ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_EXPLODES_TO_DIAMONDS | PROP_FLY,
+    [ OBJ_BUTTERFLY_DOWN_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_BUTTERFLY_LEFT_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_BUTTERFLY_UP_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_BUTTERFLY_RIGHT_SCANNED ] = PROP_ACTIVE,
+    [ OBJ_ROCKFORD ] = PROP_ACTIVE | PROP_EXPLOSIVE | PROP_KILLS_FLY,
+    [ OBJ_ROCKFORD_SCANNED ] = PROP_ACTIVE | PROP_KILLS_FLY,
+    [ OBJ_AMOEBA ] = PROP_ACTIVE | PROP_KILLS_FLY,
+    [ OBJ_AMOEBA_SCANNED ] = PROP_ACTIVE,
+};
+
+static const uint8_t flyDirections[ OBJECT_COUNT ] =
+{
+    [ OBJ_FIREFLY_LEFT ] = LEFT, [ OBJ_FIREFLY_UP ] = UP,
+    [ OBJ_FIREFLY_RIGHT ] = RIGHT, [ OBJ_FIREFLY_DOWN ] = DOWN,
+    [ OBJ_BUTTERFLY_LEFT ] = LEFT, [ OBJ_BUTTERFLY_UP ] = UP,
+    [ OBJ_BUTTERFLY_RIGHT ] = RIGHT, [ OBJ_BUTTERFLY_DOWN ] = DOWN,
+};
+
+// Indexed by [isFirefly][direction]
+static const uint8_t scannedFlies[ 2 ][ DIRECTION_COUNT ] =
+{
+    {
+        OBJ_BUTTERFLY_UP_SCANNED, OBJ_BUTTERFLY_DOWN_SCANNED, OBJ_BUTTERFLY_LEFT_SCANNED,
+        OBJ_BUTTERFLY_RIGHT_SCANNED,
+    },
+    {
+        OBJ_FIREFLY_UP_SCANNED, OBJ_FIREFLY_DOWN_SCANNED, OBJ_FIREFLY_LEFT_SCANNED, OBJ_FIREFLY_RIGHT_SCANNED,
+    },
+};
+
+static const uint8_t turnedDirections[ DIRECTION_COUNT ][ TURNING_COUNT ] =
+{
+    [ UP ] = { LEFT, UP, RIGHT },
+    [ DOWN ] = { RIGHT, DOWN, LEFT },
+    [ LEFT ] = { DOWN, LEFT, UP },
+    [ RIGHT ] = { UP, RIGHT, DOWN },
+};
+
+static const int8_t directionRowSteps[ DIRECTION_COUNT ] = { [ UP ] = -1, [ DOWN ] = 1 };
+static const int8_t directionColSteps[ DIRECTION_COUNT ] = { [ LEFT ] = -1, [ RIGHT ] = 1 };
+
+#define NORMAL_BORDER_COLOR BLACK
+#define FLASH_BORDER_COLOR GRAY
+
+_Static_assert( CAVE_WIDTH <= 64, "caveCellCover holds one row per uint64_t" );
+_Static_assert( PLAYFIELD_WIDTH_IN_TILES <= 32, "tileCover holds one row per uint32_t" );
+_Static_assert( CAVE_MAP_SIZE % sizeof(uint64_t) == 0, "map is unscanned a word at a time" );
+
+//
+// Cave decoding
+//
+
+int getMapSize(const GameState *state)
+{
+    return (state->caveHeight + 2) * state->caveStride;
+}
+
+int getActiveCellsWords(const GameState *state)
+{
+    return (getMapSize( state ) + 63) / 64;
+}
+
+int getCellCoverWords(const GameState *state)
+{
+    return state->caveHeight * state->coverStride;
+}
+
+// Points map, activeCells and cellCover at the storage in the struct when the cave fits it, otherwise
+// at the state's heap block, grown to fit. The map is rounded up to whole words, as clearScannedFlags
+// works a word at a time.
+void useCaveStorage(GameState *state)
+{
+    size_t mapSize = (getMapSize( state ) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    size_t activeCellsSize = getActiveCellsWords( state ) * sizeof(uint64_t);
+    size_t cellCoverSize = getCellCoverWords( state ) * sizeof(uint64_t);
+
+    if( getMapSize( state ) <= CAVE_MAP_SIZE && getCellCoverWords( state ) <= CAVE_HEIGHT )
+    {
+        state->map = state->caveMap;
+        state->activeCells = state->caveActiveCells;
+        state->cellCover = state->caveCellCover;
+        return;
+    }
+
+    // aligned_alloc wants a whole number of cache lines
+    size_t size = mapSize + activeCellsSize + cellCoverSize;
+    size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    if( size > state->largeCaveCapacity )
+    {
+        free( state->largeCave );
+        state->largeCave = aligned_alloc( CACHE_LINE_SIZE, size );
+        assert( state->largeCave );
+        state->largeCaveCapacity = size;
+    }
+
+    state->map = state->largeCave;
+    state->activeCells = (uint64_t*) (state->largeCave + mapSize);
+    state->cellCover = (uint64_t*) (state->largeCave + mapSize + activeCellsSize);
+}
+
+void nextRandom(int *randSeed1, int *randSeed2)
+{
+    int tempRand1 = (*randSeed1 & 0x0001) * 0x0080;
+    int tempRand2 = (*randSeed2 >> 1) & 0x007F;
+
+    int result = (*randSeed2) + (*randSeed2 & 0x0001) * 0x0080;
+    int carry = (result > 0x00FF);
+    result = result & 0x00FF;
+
+    result = result + carry + 0x13;
+    carry = (result > 0x00FF);
+    *randSeed2 = result & 0x00FF;
+
+    result = *randSeed1 + carry + tempRand1;
+    carry = (result > 0x00FF);
+    result = result & 0x00FF;
+
+    result = result + carry + tempRand2;
+    *randSeed1 = result & 0x00FF;
+}
+
+// Objects the cave data places outside a cave smaller than the original are dropped
+void placeObject(GameState *state, Object object, int row, int col)
+{
+    if( row >= 0 && row < state->caveHeight && col >= 0 && col < state->caveWidth )
+    {
+        state->map[CELL_INDEX( state, row, col )] = object;
+    }
+}
+
+void placeObjectLine(GameState *state, Object object, int row, int col, int length, int direction)
+{
+    int ldx[ 8 ] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+    int ldy[ 8 ] = { -1, -1, 0, 1, 1, 1, 0, -1 };
+
+    for( int i = 0; i < length; i++ )
+    {
+        placeObject( state, object, row + i * ldy[direction], col + i * ldx[direction] );
+    }
+}
+
+void placeObjectFilledRect(GameState *state, Object object, int row, int col, int width, int height,
+        Object fillObject)
+{
+    for( int x = 0; x < width; x++ )
+    {
+        for( int y = 0; y < height; y++ )
+        {
+            if( y == 0 || y == height - 1 || x == 0 || x == width - 1 )
+            {
+                placeObject( state, object, row + y, col + x );
+            }
+            else
+            {
+                placeObject( state, fillObject, row + y, col + x );
+            }
+        }
+    }
+}
+
+void placeObjectRect(GameState *state, Object object, int row, int col, int width, int height)
+{
+    for( int i = 0; i < width; i++ )
+    {
+        placeObject( state, object, row, col + i );
+        placeObject( state, object, row + height - 1, col + i );
+    }
+    for( int i = 0; i < height; i++ )
+    {
+        placeObject( state, object, row + i, col );
+        placeObject( state, object, row + i, col + width - 1 );
+    }
+}
+
+static uint8_t *caves[CAVE_COUNT] = { caveA, caveB, caveC, caveD, intermission1, caveE, caveF, caveG,
+        caveH, intermission2, caveI, caveJ, caveK, caveL, intermission3, caveM, caveN, caveO, caveP,
+        intermission4, };
+
+// Overrides the size a cave's data gives it, zero for the original size. The cave is laid out as
+// before and filled with random objects to its new size. Replays do not record it.
+void setCaveSize(int caveIndex, int width, int height)
+{
+    assert( caveIndex >= 0 && caveIndex < CAVE_COUNT );
+    assert( width >= 0 && width <= UINT8_MAX && height >= 0 && height <= UINT8_MAX );
+
+    CaveInfo *caveInfo = (CaveInfo*) caves[caveIndex];
+    caveInfo->caveWidth = width;
+    caveInfo->caveHeight = height;
+}
+
+void decodeCave(GameState *state, int caveIndex)
+{
+    assert( caveIndex >= 0 && caveIndex < CAVE_COUNT );
+
+    state->caveInfo = (CaveInfo*) caves[caveIndex];
+    state->loadedCaveNumber = caveIndex;
+
+    // A zero size means the size of the original caves
+    state->caveWidth = state->caveInfo->caveWidth ? state->caveInfo->caveWidth : CAVE_WIDTH;
+    state->caveHeight = state->caveInfo->caveHeight ? state->caveInfo->caveHeight : CAVE_HEIGHT;
+    state->caveStride = state->caveWidth + 2;
+    state->coverStride = (state->caveWidth + 63) / 64;
+    useCaveStorage( state );
+
+    // Clear out the state->map, sentinel border included
+    memset( state->map, OBJ_STEEL_WALL, getMapSize( state ) );
+
+    // Decode random state->map objects
+    {
+        int randSeed1 = 0;
+        int randSeed2 = state->caveInfo->randomiserSeed[0];
+
+        for( int row = 1; row < state->caveHeight; row++ )
+        {
+            for( int col = 0; col < state->caveWidth; col++ )
+            {
+                Object object = OBJ_DIRT;
+                nextRandom( &randSeed1, &randSeed2 );
+                for( int i = 0; i < NUM_RANDOM_OBJECTS; i++ )
+                {
+                    if( randSeed1 < state->caveInfo->objectProbability[i] )
+                    {
+                        object = state->caveInfo->randomObject[i];
+                    }
+                }
+                state->map[CELL_INDEX( state, row, col )] = object;
+            }
+        }
+    }
+
+    // Steel bounds
+    placeObjectRect( state, OBJ_STEEL_WALL, 0, 0, state->caveWidth, state->caveHeight );
+
+    // Decode explicit state->map data
+    {
+        uint8_t *explicitData = caves[caveIndex] + sizeof(CaveInfo);
+        int uselessTopBorderHeight = 2;
+
+        for( int i = 0; explicitData[i] != 0xFF; i++ )
+        {
+            Object object = (explicitData[i] & 0x3F);
+
+            switch( 3 & (explicitData[i] >> 6) )
+            {
+            case OBJST_SINGLE:
+            {
+                int col = explicitData[++i];
+                int row = explicitData[++i] - uselessTopBorderHeight;
+                placeObject( state, object, row, col );
+                break;
+            }
+            case OBJST_LINE:
+            {
+                int col = explicitData[++i];
+                int row = explicitData[++i] - uselessTopBorderHeight;
+                int length = explicitData[++i];
+                int direction = explicitData[++i];
+                placeObjectLine( state, object, row, col, length, direction );
+                break;
+            }
+            case OBJST_FILLED_RECT:
+            {
+                int col = explicitData[++i];
+                int row = explicitData[++i] - uselessTopBorderHeight;
+                int width = explicitData[++i];
+                int height = explicitData[++i];
+                Object fill = explicitData[++i];
+                placeObjectFilledRect( state, object, row, col, width, height, fill );
+                break;
+            }
+            case OBJST_RECT:
+            {
+                int col = explicitData[++i];
+                int row = explicitData[++i] - uselessTopBorderHeight;
+                int width = explicitData[++i];
+                int height = explicitData[++i];
+                placeObjectRect( state, object, row, col, width, height );
+                break;
+            }
+            }
+        }
+    }
+}
+
+//
+// Gameplay
+//
+
+// Per-game xorshift generator, so a game is reproducible from its seed
+// and never touches the shared libc rand() state
+uint32_t gameRandom(GameState *state)
+{
+    uint32_t x = state->randomState;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    state->randomState = x;
+    return x;
+}
+
+// Objects the cave scan acts on, including their scanned forms. Space,
+// dirt, the walls and the flashing outbox never change on their own.
+bool isObjectActive(Object object)
+{
+    return objectProperties[object] & PROP_ACTIVE;
+}
+
+// All map writes during play go through here so the active cell set stays
+// a superset of the cells holding active objects. Cells that turn inert
+// are dropped lazily by the scan.
+void setCell(GameState *state, int cell, Object object)
+{
+    state->map[cell] = object;
+    if( isObjectActive( object ) )
+    {
+        state->activeCells[cell / 64] |= (uint64_t) 1 << (cell % 64);
+    }
+}
+
+void findActiveCells(GameState *state)
+{
+    memset( state->activeCells, 0, getActiveCellsWords( state ) * sizeof(uint64_t) );
+    for( int cell = 0; cell < getMapSize( state ); ++cell )
+    {
+        if( isObjectActive( state->map[cell] ) )
+        {
+            state->activeCells[cell / 64] |= (uint64_t) 1 << (cell % 64);
+        }
+    }
+}
+
+bool isObjectRound(Object object)
+{
+    return objectProperties[object] & PROP_ROUND;
+}
+
+bool isObjectExplosive(Object object)
+{
+    return objectProperties[object] & PROP_EXPLOSIVE;
+}
+
+bool explodesToDiamonds(Object object)
+{
+    assert( isObjectExplosive( object ) );
+    return objectProperties[object] & PROP_EXPLODES_TO_DIAMONDS;
+}
+
+void explodeCell(GameState *state, int cell, bool toDiamonds, int stage)
+{
+    if( state->map[cell] != OBJ_STEEL_WALL )
+    {
+        if( toDiamonds )
+        {
+            setCell( state, cell, stage == 0 ? OBJ_EXPLODE_TO_DIAMOND_0 : OBJ_EXPLODE_TO_DIAMOND_1 );
+        }
+        else
+        {
+            setCell( state, cell, stage == 0 ? OBJ_EXPLODE_TO_SPACE_0 : OBJ_EXPLODE_TO_SPACE_1 );
+        }
+    }
+}
+
+// Cells the scan has already passed skip the first explosion stage. Map
+// order is scan order, so that is every cell up to and including scanCell.
+ALWAYS_INLINE void explode(GameState *state, int atCell, int scanCell, const int stride)
+{
+    bool toDiamonds = explodesToDiamonds( state->map[atCell] );
+
+    for( int row = -stride; row <= stride; row += stride )
+    {
+        for( int col = -1; col <= 1; ++col )
+        {
+            int cell = atCell + row + col;
+            explodeCell( state, cell, toDiamonds, cell <= scanCell ? 1 : 0 );
+        }
+    }
+}
+
+ALWAYS_INLINE void updateBoulderAndDiamond(GameState *state, int cell, bool isFalling, bool isBoulder,
+        const int stride)
+{
+    Object fallingScannedObj = isBoulder ? OBJ_BOULDER_FALLING_SCANNED : OBJ_DIAMOND_FALLING_SCANNED;
+    Object stationaryScannedObj = isBoulder ? OBJ_BOULDER_STATIONARY_SCANNED : OBJ_DIAMOND_STATIONARY_SCANNED;
+    Object fallingScannedObjInvert = isBoulder ? OBJ_DIAMOND_FALLING_SCANNED : OBJ_BOULDER_FALLING_SCANNED;
+
+    if( state->map[cell + stride] == OBJ_SPACE )
+    {
+        setCell( state, cell + stride, fallingScannedObj );
+        setCell( state, cell, OBJ_SPACE );
+        if( !isFalling )
+        {
+        }
+    }
+    else if( isFalling && state->map[cell + stride] == OBJ_MAGIC_WALL )
+    {
+        if( state->magicWallStatus == MAGIC_WALL_OFF )
+        {
+            state->magicWallStatus = MAGIC_WALL_ON;
+        }
+        if( state->magicWallStatus == MAGIC_WALL_ON && state->map[cell + 2 * stride] == OBJ_SPACE )
+        {
+            setCell( state, cell + 2 * stride, fallingScannedObjInvert );
+        }
+        setCell( state, cell, OBJ_SPACE );
+    }
+    else if( isObjectRound( state->map[cell + stride] ) )
+    {
+        // Try to roll off
+        if( state->map[cell - 1] == OBJ_SPACE && state->map[cell + stride - 1] == OBJ_SPACE )
+        {
+            // Roll left
+            setCell( state, cell - 1, fallingScannedObj );
+            setCell( state, cell, OBJ_SPACE );
+        }
+        else if( state->map[cell + 1] == OBJ_SPACE && state->map[cell + stride + 1] == OBJ_SPACE )
+        {
+            // Roll right
+            setCell( state, cell + 1, fallingScannedObj );
+            setCell( state, cell, OBJ_SPACE );
+        }
+        else
+        {
+            setCell( state, cell, stationaryScannedObj );
+            if( isFalling )
+            {
+            }
+        }
+    }
+    else if( isFalling && isObjectExplosive( state->map[cell + stride] ) )
+    {
+        explode( state, cell + stride, cell, stride );
+    }
+    else
+    {
+        setCell( state, cell, stationaryScannedObj );
+        if( isFalling )
+        {
+        }
+    }
+}
+
+bool isFailed(const GameState *state)
+{
+    return state->turnsSinceRockfordSeenAlive >= 16 || state->isOutOfTime;
+}
+
+bool checkFlyExplode(Object object)
+{
+    return objectProperties[object] & PROP_KILLS_FLY;
+}
+
+ALWAYS_INLINE int getDirectionOffset(Direction direction, const int stride)
+{
+    return directionRowSteps[direction] * stride + directionColSteps[direction];
+}
+
+ALWAYS_INLINE void getNewFlyPosition(int curCell, Direction curDirection, Turning turning, int *newCell,
+        Direction *newDirection, const int stride)
+{
+    *newDirection = turnedDirections[curDirection][turning];
+    *newCell = curCell + getDirectionOffset( *newDirection, stride );
+}
+
+Object getFlyScanned(Direction direction, bool isFirefly)
+{
+    return scannedFlies[isFirefly][direction];
+}
+
+Direction getFlyDirection(Object fly, bool isFirefly)
+{
+    assert( (objectProperties[fly] & PROP_FLY)
+            && isFirefly == (fly >= OBJ_FIREFLY_LEFT && fly <= OBJ_FIREFLY_DOWN) );
+    return flyDirections[fly];
+}
+
+ALWAYS_INLINE void updateFly(GameState *state, int cell, bool isFirefly, const int stride)
+{
+    if( checkFlyExplode( state->map[cell - stride] ) || checkFlyExplode( state->map[cell + stride] )
+            || checkFlyExplode( state->map[cell - 1] ) || checkFlyExplode( state->map[cell + 1] ) )
+    {
+        explode( state, cell, cell, stride );
+    }
+    else
+    {
+        int direction = getFlyDirection( state->map[cell], isFirefly );
+        int newCell;
+        Direction newDirection;
+        getNewFlyPosition( cell, direction, (isFirefly ? TURN_LEFT : TURN_RIGHT), &newCell, &newDirection,
+                stride );
+        if( state->map[newCell] == OBJ_SPACE )
+        {
+            setCell( state, newCell, getFlyScanned( newDirection, isFirefly ) );
+            setCell( state, cell, OBJ_SPACE );
+        }
+        else
+        {
+            getNewFlyPosition( cell, direction, STRAIGHT_AHEAD, &newCell, &newDirection, stride );
+            if( state->map[newCell] == OBJ_SPACE )
+            {
+                setCell( state, newCell, getFlyScanned( newDirection, isFirefly ) );
+                setCell( state, cell, OBJ_SPACE );
+            }
+            else
+            {
+                getNewFlyPosition( cell, direction, (isFirefly ? TURN_RIGHT : TURN_LEFT), &newCell,
+                        &newDirection, stride );
+                setCell( state, cell, getFlyScanned( newDirection, isFirefly ) );
+            }
+        }
+    }
+}
+
+void addScore(GameState *state, int amount)
+{
+    state->score += amount;
+
+    // Check for bonus life
+    state->scoreTillBonusLife -= amount;
+    if( state->scoreTillBonusLife <= 0 )
+    {
+        state->scoreTillBonusLife += BONUS_LIFE_COST;
+        state->spaceFlashingTurnsLeft = SPACE_FLASHING_TURNS;
+        ++state->livesLeft;
+        if( state->livesLeft > MAX_LIVES )
+        {
+            state->livesLeft = MAX_LIVES;
+        }
+    }
+}
+
+bool isIntermission(const GameState *state)
+{
+    return ((state->currentCaveNumber + 1) % 5) == 0;
+}
+
+void incrementCaveNumber(GameState *state)
+{
+    ++state->currentCaveNumber;
+    if( state->currentCaveNumber >= CAVE_COUNT )
+    {
+        state->currentCaveNumber = 0;
+        if( state->difficultyLevel < NUM_DIFFICULTY_LEVELS - 1 )
+        {
+            ++state->difficultyLevel;
+        }
+    }
+}
+
+char getCurrentCaveLetter(const GameState *state)
+{
+    switch( state->currentCaveNumber )
+    {
+    case CAVE_A:
+        return 'A';
+    case CAVE_B:
+        return 'B';
+    case CAVE_C:
+        return 'C';
+    case CAVE_D:
+        return 'D';
+    case CAVE_E:
+        return 'E';
+    case CAVE_F:
+        return 'F';
+    case CAVE_G:
+        return 'G';
+    case CAVE_H:
+        return 'H';
+    case CAVE_I:
+        return 'I';
+    case CAVE_J:
+        return 'J';
+    case CAVE_K:
+        return 'K';
+    case CAVE_L:
+        return 'L';
+    case CAVE_M:
+        return 'M';
+    case CAVE_N:
+        return 'N';
+    case CAVE_O:
+        return 'O';
+    case CAVE_P:
+        return 'P';
+    }
+    return ' ';
+}
+
+bool canAmoebaGrowHere(GameState *state, int cell)
+{
+    return state->map[cell] == OBJ_SPACE || state->map[cell] == OBJ_DIRT;
+}
+
+ALWAYS_INLINE int getRandomCellNear(GameState *state, int cell, const int stride)
+{
+    return cell + getDirectionOffset( gameRandom( state ) % DIRECTION_COUNT, stride );
+}
+
+bool isKeyDown(Input input, KEYS key)
+{
+    return (input & KEY_BIT( key )) != 0;
+}
+
+bool isCellCovered(const GameState *state, int row, int col)
+{
+    return (state->cellCover[row * state->coverStride + col / 64] >> (col % 64)) & 1;
+}
+
+bool isTileCovered(const GameState *state, int row, int col)
+{
+    return (state->tileCover[row] >> col) & 1;
+}
+
+// Scans the cave for a given map stride. Only cells in the active set are
+// visited, still in top-left to bottom-right order. Each word of the set is
+// re-read after every cell, so objects placed further along by this scan are
+// picked up exactly as before.
+ALWAYS_INLINE void scanCaveWithStride(GameState *state, Input input, const int stride)
+{
+    // Byte stores into the map may alias the state's pointers, so keep them in locals
+    uint8_t *map = state->map;
+    uint64_t *activeCells = state->activeCells;
+    int words = ((state->caveHeight + 2) * stride + 63) / 64;
+    for( int word = 0; word < words; ++word )
+    {
+        uint64_t pending = activeCells[word];
+        while( pending )
+        {
+            int bit = __builtin_ctzll( pending );
+            int cell = word * 64 + bit;
+            if( !isObjectActive( map[cell] ) )
+            {
+                activeCells[word] &= ~((uint64_t) 1 << bit);
+            }
+
+            switch( map[cell] )
+            {
+            case OBJ_PRE_ROCKFORD_1:
+                state->turnsSinceRockfordSeenAlive = 0;
+                if( state->rockfordTurnsTillBirth == 0 )
+                {
+                    setCell( state, cell, OBJ_PRE_ROCKFORD_2 );
+                }
+                else if( state->cellCoverTurnsLeft == 0 )
+                {
+                    state->rockfordTurnsTillBirth--;
+                }
+                break;
+
+            case OBJ_PRE_ROCKFORD_2:
+                state->turnsSinceRockfordSeenAlive = 0;
+                setCell( state, cell, OBJ_PRE_ROCKFORD_3 );
+                break;
+
+            case OBJ_PRE_ROCKFORD_3:
+                state->turnsSinceRockfordSeenAlive = 0;
+                setCell( state, cell, OBJ_PRE_ROCKFORD_4 );
+                break;
+
+            case OBJ_PRE_ROCKFORD_4:
+                state->turnsSinceRockfordSeenAlive = 0;
+                setCell( state, cell, OBJ_ROCKFORD );
+                break;
+
+                //
+                // Update Rockford
+                //
+
+            case OBJ_ROCKFORD:
+            {
+                state->turnsSinceRockfordSeenAlive = 0;
+
+                int newCell = cell;
+
+                state->rockfordIsMoving = false;
+                state->rockfordHasSnapped = false;
+
+                if( !state->isOutOfTime && state->tileCoverTicksLeft == 0 )
+                {
+                    if( isKeyDown( input, KEY_RIGHT ) )
+                    {
+                        state->rockfordIsMoving = true;
+                        state->rockfordIsFacingRight = true;
+                        ++newCell;
+                    }
+                    else if( isKeyDown( input, KEY_LEFT ) )
+                    {
+                        state->rockfordIsMoving = true;
+                        state->rockfordIsFacingRight = false;
+                        --newCell;
+                    }
+                    else if( isKeyDown( input, KEY_DOWN ) )
+                    {
+                        state->rockfordIsMoving = true;
+                        newCell += stride;
+                    }
+                    else if( isKeyDown( input, KEY_UP ) )
+                    {
+                        state->rockfordIsMoving = true;
+                        newCell -= stride;
+                    }
+                }
+
+                bool actuallyMoved = false;
+
+                switch( state->map[newCell] )
+                {
+                case OBJ_SPACE:
+                    actuallyMoved = true;
+                    break;
+
+                case OBJ_DIRT:
+                    actuallyMoved = true;
+                    break;
+
+                case OBJ_DIAMOND_STATIONARY:
+                case OBJ_DIAMOND_STATIONARY_SCANNED:
+                    //
+                    // Pick up a diamond
+                    //
+
+                    actuallyMoved = true;
+                    addScore( state, state->currentDiamondValue );
+
+                    // Check if all the needed diamonds for this cave were collected
+                    ++state->diamondsCollected;
+                    if( state->diamondsCollected
+                            == state->caveInfo->diamondsNeeded[state->difficultyLevel] )
+                    {
+                        state->currentDiamondValue = state->caveInfo->extraDiamondValue;
+                        state->borderColor = FLASH_BORDER_COLOR;
+                    }
+                    break;
+
+                case OBJ_BOULDER_STATIONARY:
+                case OBJ_BOULDER_STATIONARY_SCANNED:
+                    // Pushing boulders
+                    if( gameRandom( state ) % 4 == 0 )
+                    {
+                        if( isKeyDown( input, KEY_RIGHT )
+                                && state->map[newCell + 1] == OBJ_SPACE )
+                        {
+                            setCell( state, newCell + 1, OBJ_BOULDER_STATIONARY_SCANNED );
+                            actuallyMoved = true;
+                        }
+                        else if( isKeyDown( input, KEY_LEFT )
+                                && state->map[newCell - 1] == OBJ_SPACE )
+                        {
+                            setCell( state, newCell - 1, OBJ_BOULDER_STATIONARY_SCANNED );
+                            actuallyMoved = true;
+                        }
+                    }
+                    break;
+
+                case OBJ_FLASHING_OUTBOX:
+                    actuallyMoved = true;
+                    state->isAddingTimeToScore = true;
+                    break;
+                }
+
+                if( actuallyMoved )
+                {
+                    if( isKeyDown( input, KEY_FIRE ) )
+                    {
+                        setCell( state, newCell, OBJ_SPACE );
+                        state->rockfordHasSnapped = true;
+                    }
+                    else
+                    {
+                        setCell( state, cell, OBJ_SPACE );
+                        setCell( state, newCell, OBJ_ROCKFORD_SCANNED );
+                        state->rockfordRow = CELL_ROW( state, newCell );
+                        state->rockfordCol = CELL_COL( state, newCell );
+                    }
+                }
+
+                //
+                // Update Rockford idle animation
+                //
+
+                if( state->rockfordIsMoving )
+                {
+                    state->rockfordIsBlinking = false;
+                    state->rockfordIsTapping = false;
+                }
+                else
+                {
+                    if( state->tick % 8 == 0 )
+                    {
+                        state->rockfordIsBlinking = gameRandom( state ) % 4 == 0;
+                        if( gameRandom( state ) % 16 == 0 )
+                        {
+                            state->rockfordIsTapping = !state->rockfordIsTapping;
+                        }
+                    }
+                }
+                break;
+            }
+
+                //
+                // Update boulders and diamonds
+                //
+
+            case OBJ_BOULDER_STATIONARY:
+            case OBJ_BOULDER_FALLING:
+                updateBoulderAndDiamond( state, cell,
+                        map[cell] == OBJ_BOULDER_FALLING, true, stride );
+                break;
+
+            case OBJ_DIAMOND_STATIONARY:
+            case OBJ_DIAMOND_FALLING:
+                updateBoulderAndDiamond( state, cell,
+                        map[cell] == OBJ_DIAMOND_FALLING, false, stride );
+                break;
+
+                //
+                // Update explosion
+                //
+
+            case OBJ_EXPLODE_TO_SPACE_0:
+                setCell( state, cell, OBJ_EXPLODE_TO_SPACE_1 );
+                break;
+            case OBJ_EXPLODE_TO_SPACE_1:
+                setCell( state, cell, OBJ_EXPLODE_TO_SPACE_2 );
+                break;
+            case OBJ_EXPLODE_TO_SPACE_2:
+                setCell( state, cell, OBJ_EXPLODE_TO_SPACE_3 );
+                break;
+            case OBJ_EXPLODE_TO_SPACE_3:
+                setCell( state, cell, OBJ_EXPLODE_TO_SPACE_4 );
+                break;
+            case OBJ_EXPLODE_TO_SPACE_4:
+                setCell( state, cell, OBJ_SPACE );
+                break;
+
+            case OBJ_EXPLODE_TO_DIAMOND_0:
+                setCell( state, cell, OBJ_EXPLODE_TO_DIAMOND_1 );
+                break;
+            case OBJ_EXPLODE_TO_DIAMOND_1:
+                setCell( state, cell, OBJ_EXPLODE_TO_DIAMOND_2 );
+                break;
+            case OBJ_EXPLODE_TO_DIAMOND_2:
+                setCell( state, cell, OBJ_EXPLODE_TO_DIAMOND_3 );
+                break;
+            case OBJ_EXPLODE_TO_DIAMOND_3:
+                setCell( state, cell, OBJ_EXPLODE_TO_DIAMOND_4 );
+                break;
+            case OBJ_EXPLODE_TO_DIAMOND_4:
+                setCell( state, cell, OBJ_DIAMOND_STATIONARY );
+                break;
+
+                //
+                // Update out box
+                //
+
+            case OBJ_PRE_OUTBOX:
+                if( state->diamondsCollected
+                        >= state->caveInfo->diamondsNeeded[state->difficultyLevel] )
+                {
+                    setCell( state, cell, OBJ_FLASHING_OUTBOX );
+                }
+                break;
+
+                //
+                // Update fireflies and butterflies
+                //
+
+            case OBJ_FIREFLY_LEFT:
+            case OBJ_FIREFLY_UP:
+            case OBJ_FIREFLY_RIGHT:
+            case OBJ_FIREFLY_DOWN:
+                updateFly( state, cell, true, stride );
+                break;
+
+            case OBJ_BUTTERFLY_LEFT:
+            case OBJ_BUTTERFLY_UP:
+            case OBJ_BUTTERFLY_RIGHT:
+            case OBJ_BUTTERFLY_DOWN:
+                updateFly( state, cell, false, stride );
+                break;
+
+                //
+                // Update amoeba
+                //
+
+            case OBJ_AMOEBA:
+                ++state->numberOfAmoebaFoundThisTurn;
+                if( state->totalAmoebaFoundLastTurn >= TOO_MANY_AMOEBA )
+                {
+                    setCell( state, cell, OBJ_BOULDER_STATIONARY );
+                }
+                else if( state->amoebaSuffocatedLastTurn )
+                {
+                    setCell( state, cell, OBJ_DIAMOND_STATIONARY );
+                }
+                else
+                {
+                    if( !state->atLeastOneAmoebaFoundThisTurnWhichCanGrow )
+                    {
+                        state->atLeastOneAmoebaFoundThisTurnWhichCanGrow =
+                                canAmoebaGrowHere( state, cell - stride )
+                                || canAmoebaGrowHere( state, cell + stride )
+                                || canAmoebaGrowHere( state, cell - 1 )
+                                || canAmoebaGrowHere( state, cell + 1 );
+                    }
+                    int amoebaRandomFactor =
+                            state->amoebaSlowGrowthTimeLeft > 0 ?
+                                    AMOEBA_FACTOR_SLOW : AMOEBA_FACTOR_FAST;
+                    if( (gameRandom( state ) % amoebaRandomFactor) < 4 )
+                    {
+                        int newCell = getRandomCellNear( state, cell, stride );
+                        if( canAmoebaGrowHere( state, newCell ) )
+                        {
+                            setCell( state, newCell, OBJ_AMOEBA );
+                        }
+                    }
+                }
+                break;
+            }
+
+            pending = activeCells[word] & ~(((uint64_t) 2 << bit) - 1);
+        }
+    }
+}
+
+void scanCave(GameState *state, Input input)
+{
+    // The original caves get their own copy of the scan, with the stride known at compile time
+    if( state->caveStride == CAVE_STRIDE )
+    {
+        scanCaveWithStride( state, input, CAVE_STRIDE );
+    }
+    else
+    {
+        scanCaveWithStride( state, input, state->caveStride );
+    }
+}
+
+// Drops the scanned flag from every cell, eight cells per word
+void clearScannedFlags(GameState *state)
+{
+    const uint64_t mask = ~(uint64_t) 0 / 0xFF * (uint8_t) ~OBJ_SCANNED;
+    uint8_t *cells = state->map;
+
+    for( int i = 0; i < getMapSize( state ); i += sizeof(uint64_t) )
+    {
+        uint64_t word;
+        memcpy( &word, cells + i, sizeof(word) );
+        word &= mask;
+        memcpy( cells + i, &word, sizeof(word) );
+    }
+}
+
+//
+// Game state
+//
+
+void initGameState(GameState *state, int startCave, int startDifficultyLevel, uint32_t seed)
+{
+    assert( startCave >= 0 && startCave < CAVE_COUNT );
+    assert( startDifficultyLevel >= 0 && startDifficultyLevel < NUM_DIFFICULTY_LEVELS );
+
+    // Keep the heap block for the next big cave
+    uint8_t *largeCave = state->largeCave;
+    size_t largeCaveCapacity = state->largeCaveCapacity;
+    memset( state, 0, sizeof(*state) );
+    state->largeCave = largeCave;
+    state->largeCaveCapacity = largeCaveCapacity;
+    useCaveStorage( state );
+
+    state->startCave = startCave;
+    state->startDifficultyLevel = startDifficultyLevel;
+    state->randomState = seed ? seed : 0x2545F491; // xorshift must not start at zero
+    state->isGameStart = true;
+    state->borderColor = NORMAL_BORDER_COLOR;
+}
+
+void cloneGameState(GameState *dst, const GameState *src)
+{
+    uint8_t *largeCave = dst->largeCave;
+    size_t largeCaveCapacity = dst->largeCaveCapacity;
+    memcpy( dst, src, sizeof(*dst) );
+    dst->largeCave = largeCave;
+    dst->largeCaveCapacity = largeCaveCapacity;
+
+    // Before the first cave is decoded there is nothing to point at
+    if( src->map )
+    {
+        useCaveStorage( dst );
+        if( src->map != src->caveMap )
+        {
+            memcpy( dst->map, src->map, getMapSize( src ) );
+            memcpy( dst->activeCells, src->activeCells, getActiveCellsWords( src ) * sizeof(uint64_t) );
+            memcpy( dst->cellCover, src->cellCover, getCellCoverWords( src ) * sizeof(uint64_t) );
+        }
+    }
+}
+
+void freeGameState(GameState *state)
+{
+    free( state->largeCave );
+    state->largeCave = NULL;
+    state->largeCaveCapacity = 0;
+    state->map = NULL;
+}
+
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for( size_t i = 0; i < size; ++i )
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// FNV-1a over everything that defines the game, leaving out the cave
+// data pointer so hashes match between builds. The map is hashed row by
+// row without its sentinel border.
+uint64_t hashGameState(const GameState *state)
+{
+    int values[] =
+    {
+        state->tick, state->turn, state->currentCaveNumber, state->difficultyLevel, state->livesLeft,
+        state->score, state->diamondsCollected, state->caveTimeLeft, state->rockfordRow, state->rockfordCol,
+        state->cameraX, state->cameraY, state->randomState,
+    };
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for( int row = 0; row < state->caveHeight; ++row )
+    {
+        hash = hashBytes( hash, &state->map[CELL_INDEX( state, row, 0 )], state->caveWidth );
+    }
+    hash = hashBytes( hash, state->cellCover, getCellCoverWords( state ) * sizeof(*state->cellCover) );
+    hash = hashBytes( hash, state->tileCover, sizeof(state->tileCover) );
+    hash = hashBytes( hash, values, sizeof(values) );
+    return hash;
+}
+
+void stepGame(GameState *state, Input input)
+{
+    // Initialisation on game start
+    if( state->isGameStart )
+    {
+        state->isGameStart = false;
+
+        state->isCaveStart = true;
+        state->pauseTurnsLeft = 0;
+        state->currentCaveNumber = state->startCave;
+        state->difficultyLevel = state->startDifficultyLevel;
+        state->livesLeft = DEV_SINGLE_LIFE ? 1 : 3;
+        state->score = 0;
+        state->scoreTillBonusLife = BONUS_LIFE_COST;
+        state->spaceFlashingTurnsLeft = 0;
+    }
+
+    // Initialisation on cave start
+    if( state->isCaveStart && state->pauseTurnsLeft == 0 )
+    {
+        state->isCaveStart = false;
+
+        decodeCave( state, state->currentCaveNumber );
+        findActiveCells( state );
+
+        state->isExitingCave = false;
+        state->turnsSinceRockfordSeenAlive = 0;
+        state->diamondsCollected = 0;
+        state->currentDiamondValue = state->caveInfo->initialDiamondValue;
+        state->caveTimeLeft = DEV_QUICK_OUT_OF_TIME ? 5 : state->caveInfo->caveTime[state->difficultyLevel];
+
+        state->amoebaSlowGrowthTimeLeft = state->caveInfo->magicWallMillingTime;
+        state->magicWallMillingTimeLeft = state->caveInfo->magicWallMillingTime;
+
+        state->ticksTillNextCaveSecond = TICKS_PER_CAVE_SECOND;
+        state->isOutOfTime = false;
+        state->isOutOfTimeTextShown = false;
+        state->outOfTimeTurn = 0;
+        state->rockfordTurnsTillBirth = DEV_IMMEDIATE_STARTUP ? 0 : ROCKFORD_TURNS_TILL_BIRTH;
+        state->cellCoverTurnsLeft = DEV_IMMEDIATE_STARTUP ? 1 : CELL_COVER_TURNS;
+        state->magicWallStatus = MAGIC_WALL_OFF;
+
+        state->numberOfAmoebaFoundThisTurn = 0;
+        state->totalAmoebaFoundLastTurn = 0;
+        state->amoebaSuffocatedLastTurn = false;
+        state->atLeastOneAmoebaFoundThisTurnWhichCanGrow = true;
+
+        state->rockfordIsBlinking = false;
+        state->rockfordIsTapping = false;
+        state->tileCoverTicksLeft = 0;
+        state->rockfordIsMoving = false;
+        state->rockfordHasSnapped = false;
+        state->rockfordIsFacingRight = true;
+
+        if( DEV_SINGLE_DIAMOND_NEEDED )
+        {
+            state->caveInfo->diamondsNeeded[state->difficultyLevel] = 1;
+        }
+
+        for( int row = 0; row < state->caveHeight; ++row )
+        {
+            uint64_t *cover = &state->cellCover[row * state->coverStride];
+            for( int word = 0; word < state->coverStride; ++word )
+            {
+                int cols = state->caveWidth - word * 64;
+                cover[word] = cols < 64 ? ~(uint64_t) 0 >> (64 - cols) : ~(uint64_t) 0;
+            }
+        }
+
+        for( int row = 0; row < PLAYFIELD_HEIGHT_IN_TILES; ++row )
+        {
+            state->tileCover[row] = 0;
+        }
+
+        // Find initial rockford position
+        for( int row = 0; row < state->caveHeight; ++row )
+        {
+            for( int col = 0; col < state->caveWidth; ++col )
+            {
+                if( state->map[CELL_INDEX( state, row, col )] == OBJ_PRE_ROCKFORD_1 )
+                {
+                    state->rockfordRow = row;
+                    state->rockfordCol = col;
+                    if( DEV_NEAR_OUTBOX )
+                    {
+                        setCell( state, CELL_INDEX( state, row - 1, col ), OBJ_FLASHING_OUTBOX );
+                    }
+                }
+            }
+        }
+    }
+
+    state->tick++;
+
+    //
+    // Do tick
+    //
+
+    int rockfordRectLeft = PLAYFIELD_LEFT + state->rockfordCol * CELL_SIZE - state->cameraX;
+    int rockfordRectTop = PLAYFIELD_TOP + state->rockfordRow * CELL_SIZE - state->cameraY;
+    int rockfordRectRight = rockfordRectLeft + CELL_SIZE;
+    int rockfordRectBottom = rockfordRectTop + CELL_SIZE;
+
+    if( state->isAddingTimeToScore )
+    {
+        if( state->caveTimeLeft > 0 )
+        {
+            --state->caveTimeLeft;
+            addScore( state, 1 );
+        }
+        else
+        {
+            state->isAddingTimeToScore = false;
+            state->isExitingCave = true;
+            incrementCaveNumber( state );
+            state->turnsTillExitingCave = TURNS_TILL_EXITING_CAVE;
+        }
+    }
+    else
+    {
+        //
+        // Update cave timer
+        //
+
+        if( state->turnsTillExitingCave == 0 && state->tileCoverTicksLeft == 0
+                && state->rockfordTurnsTillBirth == 0 && !state->isOutOfTime )
+        {
+            --state->ticksTillNextCaveSecond;
+            if( state->ticksTillNextCaveSecond == 0 )
+            {
+                state->ticksTillNextCaveSecond = TICKS_PER_CAVE_SECOND;
+                if( state->caveTimeLeft > 0 )
+                {
+                    --state->caveTimeLeft;
+
+                    if( state->amoebaSlowGrowthTimeLeft > 0 )
+                    {
+                        --state->amoebaSlowGrowthTimeLeft;
+                    }
+
+                    if( state->magicWallStatus == MAGIC_WALL_ON )
+                    {
+                        --state->magicWallMillingTimeLeft;
+                        if( state->magicWallMillingTimeLeft == 0 )
+                        {
+                            state->magicWallStatus = MAGIC_WALL_EXPIRED;
+                        }
+                    }
+                }
+                else
+                {
+                    state->isOutOfTime = true;
+                    state->isOutOfTimeTextShown = true;
+                }
+            }
+        }
+
+        //
+        // Turn-based update logic
+        //
+
+        if( state->tick % TICKS_PER_TURN == 0 )
+        {
+            if( state->pauseTurnsLeft > 0 )
+            {
+                state->pauseTurnsLeft--;
+            }
+            else
+            {
+                state->turn++;
+
+                //
+                // Do turn
+                //
+
+                state->borderColor = NORMAL_BORDER_COLOR;
+
+                if( state->turnsTillExitingCave == 0 && state->spaceFlashingTurnsLeft > 0 )
+                {
+                    --state->spaceFlashingTurnsLeft;
+                }
+
+                if( state->magicWallStatus == MAGIC_WALL_ON )
+                {
+                }
+
+                //
+                // Move camera
+                //
+
+                if( rockfordRectRight > CAMERA_START_RIGHT )
+                {
+                    state->cameraVelX = CAMERA_STEP;
+                }
+                else if( rockfordRectLeft < CAMERA_START_LEFT )
+                {
+                    state->cameraVelX = -CAMERA_STEP;
+                }
+                if( rockfordRectBottom > CAMERA_START_BOTTOM )
+                {
+                    state->cameraVelY = CAMERA_STEP;
+                }
+                else if( rockfordRectTop < CAMERA_START_TOP )
+                {
+                    state->cameraVelY = -CAMERA_STEP;
+                }
+
+                if( rockfordRectLeft >= CAMERA_STOP_LEFT && rockfordRectRight <= CAMERA_STOP_RIGHT )
+                {
+                    state->cameraVelX = 0;
+                }
+                if( rockfordRectTop >= CAMERA_STOP_TOP && rockfordRectBottom <= CAMERA_STOP_BOTTOM )
+                {
+                    state->cameraVelY = 0;
+                }
+
+                state->cameraX += state->cameraVelX;
+                state->cameraY += state->cameraVelY;
+
+                if( state->cameraX < CAMERA_X_MIN )
+                {
+                    state->cameraX = CAMERA_X_MIN;
+                }
+                else if( state->cameraX > CAMERA_X_MAX( state->caveWidth ) )
+                {
+                    state->cameraX = CAMERA_X_MAX( state->caveWidth );
+                }
+
+                if( state->cameraY < CAMERA_Y_MIN )
+                {
+                    state->cameraY = CAMERA_Y_MIN;
+                }
+                else if( state->cameraY > CAMERA_Y_MAX( state->caveHeight ) )
+                {
+                    state->cameraY = CAMERA_Y_MAX( state->caveHeight );
+                }
+
+                //
+                // Out of time
+                //
+
+                if( state->isOutOfTime )
+                {
+                    ++state->outOfTimeTurn;
+                    if( state->isOutOfTimeTextShown )
+                    {
+                        if( state->outOfTimeTurn == OUT_OF_TIME_ON_TURNS )
+                        {
+                            state->outOfTimeTurn = 0;
+                            state->isOutOfTimeTextShown = false;
+                        }
+                    }
+                    else
+                    {
+                        if( state->outOfTimeTurn == OUT_OF_TIME_OFF_TURNS )
+                        {
+                            state->outOfTimeTurn = 0;
+                            state->isOutOfTimeTextShown = true;
+                        }
+                    }
+                }
+
+                //////////////////////
+
+                if( state->turnsTillGameRestart > 0 )
+                {
+                    --state->turnsTillGameRestart;
+                    if( state->turnsTillGameRestart == 0 )
+                    {
+                        state->isGameStart = true;
+                    }
+                }
+                else if( state->turnsTillExitingCave > 0 )
+                {
+                    --state->turnsTillExitingCave;
+                    if( state->turnsTillExitingCave == 0 )
+                    {
+                        state->tileCoverTicksLeft = TILE_COVER_TICKS;
+                    }
+                }
+                else if( state->isExitingCave )
+                {
+                    // Do nothing
+                }
+                else if( state->cellCoverTurnsLeft > 0 )
+                {
+                    //
+                    // Update cell cover
+                    //
+
+                    state->cellCoverTurnsLeft--;
+                    if( state->cellCoverTurnsLeft > 1 )
+                    {
+                        for( int row = 0; row < state->caveHeight; ++row )
+                        {
+                            for( int i = 0; i < 3; ++i )
+                            {
+                                int col = gameRandom( state ) % state->caveWidth;
+                                state->cellCover[row * state->coverStride + col / 64] &=
+                                        ~((uint64_t) 1 << (col % 64));
+                            }
+                        }
+                    }
+                    else if( state->cellCoverTurnsLeft == 1 )
+                    {
+                        state->pauseTurnsLeft = COVER_PAUSE;
+                    }
+                    else if( state->cellCoverTurnsLeft == 0 )
+                    {
+                        memset( state->cellCover, 0, getCellCoverWords( state ) * sizeof(uint64_t) );
+                    }
+                }
+                else
+                {
+                    //
+                    // Before cave scanning
+                    //
+
+                    ++state->turnsSinceRockfordSeenAlive;
+
+                    /////
+
+                    state->totalAmoebaFoundLastTurn = state->numberOfAmoebaFoundThisTurn;
+                    state->numberOfAmoebaFoundThisTurn = 0;
+
+                    state->amoebaSuffocatedLastTurn = !state->atLeastOneAmoebaFoundThisTurnWhichCanGrow;
+                    state->atLeastOneAmoebaFoundThisTurnWhichCanGrow = false;
+
+                    //
+                    // Scan cave
+                    //
+
+                    scanCave( state, input );
+
+                    //
+                    // Remove scanned status for cells
+                    //
+
+                    clearScannedFlags( state );
+
+                    //
+                    // Handle failure
+                    //
+
+                    if( state->tileCoverTicksLeft == 0 && state->rockfordTurnsTillBirth == 0
+                            && ((isFailed( state ) && isKeyDown( input, KEY_FIRE ))
+                                    || isKeyDown( input, KEY_FAIL )) )
+                    {
+                        state->tileCoverTicksLeft = TILE_COVER_TICKS;
+                        if( isIntermission( state ) )
+                        {
+                            incrementCaveNumber( state );
+                        }
+                        else
+                        {
+                            --state->livesLeft;
+                        }
+                    }
+                }
+            }
+        }
+
+        //
+        // Update tile cover
+        //
+
+        if( state->tileCoverTicksLeft > 0 )
+        {
+            --state->tileCoverTicksLeft;
+
+            if( state->tileCoverTicksLeft == 0 )
+            {
+                if( state->livesLeft == 0 )
+                {
+                    for( int row = 0; row < PLAYFIELD_HEIGHT_IN_TILES; ++row )
+                    {
+                        state->tileCover[row] = ~(uint32_t) 0 >> (32 - PLAYFIELD_WIDTH_IN_TILES);
+                    }
+                    state->turnsTillGameRestart = TURNS_TILL_GAME_RESTART;
+                }
+                else
+                {
+                    state->pauseTurnsLeft = COVER_PAUSE;
+                    state->isCaveStart = true;
+                }
+            }
+            else
+            {
+                for( int i = 0; i < 7; ++i )
+                {
+                    int row = gameRandom( state ) % PLAYFIELD_HEIGHT_IN_TILES;
+                    int col = gameRandom( state ) % PLAYFIELD_WIDTH_IN_TILES;
+                    state->tileCover[row] |= (uint32_t) 1 << col;
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,239 @@
+#ifndef SIMULATION_H_
+#define SIMULATION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdalign.h>
+
+#include "game.h"
+
+#define CACHE_LINE_SIZE 64
+
+// Set on objects the cave scan has already moved or updated this turn,
+// cleared for the whole map once the scan is done
+#define OBJ_SCANNED 0x40
+
+typedef enum
+{
+    OBJ_SPACE = 0x00,
+    OBJ_DIRT = 0x01,
+    OBJ_BRICK_WALL = 0x02,
+    OBJ_MAGIC_WALL = 0x03,
+    OBJ_PRE_OUTBOX = 0x04,
+    OBJ_FLASHING_OUTBOX = 0x05,
+    OBJ_STEEL_WALL = 0x07,
+    OBJ_FIREFLY_LEFT = 0x08,
+    OBJ_FIREFLY_UP = 0x09,
+    OBJ_FIREFLY_RIGHT = 0x0A,
+    OBJ_FIREFLY_DOWN = 0x0B,
+    OBJ_FIREFLY_LEFT_SCANNED = OBJ_FIREFLY_LEFT | OBJ_SCANNED,
+    OBJ_FIREFLY_UP_SCANNED = OBJ_FIREFLY_UP | OBJ_SCANNED,
+    OBJ_FIREFLY_RIGHT_SCANNED = OBJ_FIREFLY_RIGHT | OBJ_SCANNED,
+    OBJ_FIREFLY_DOWN_SCANNED = OBJ_FIREFLY_DOWN | OBJ_SCANNED,
+    OBJ_BOULDER_STATIONARY = 0x10,
+    OBJ_BOULDER_STATIONARY_SCANNED = OBJ_BOULDER_STATIONARY | OBJ_SCANNED,
+    OBJ_BOULDER_FALLING = 0x12,
+    OBJ_BOULDER_FALLING_SCANNED = OBJ_BOULDER_FALLING | OBJ_SCANNED,
+    OBJ_DIAMOND_STATIONARY = 0x14,
+    OBJ_DIAMOND_STATIONARY_SCANNED = OBJ_DIAMOND_STATIONARY | OBJ_SCANNED,
+    OBJ_DIAMOND_FALLING = 0x16,
+    OBJ_DIAMOND_FALLING_SCANNED = OBJ_DIAMOND_FALLING | OBJ_SCANNED,
+    OBJ_EXPLODE_TO_SPACE_0 = 0x1B,
+    OBJ_EXPLODE_TO_SPACE_1 = 0x1C,
+    OBJ_EXPLODE_TO_SPACE_2 = 0x1D,
+    OBJ_EXPLODE_TO_SPACE_3 = 0x1E,
+    OBJ_EXPLODE_TO_SPACE_4 = 0x1F,
+    OBJ_EXPLODE_TO_DIAMOND_0 = 0x20,
+    OBJ_EXPLODE_TO_DIAMOND_1 = 0x21,
+    OBJ_EXPLODE_TO_DIAMOND_2 = 0x22,
+    OBJ_EXPLODE_TO_DIAMOND_3 = 0x23,
+    OBJ_EXPLODE_TO_DIAMOND_4 = 0x24,
+    OBJ_PRE_ROCKFORD_1 = 0x25,
+    OBJ_PRE_ROCKFORD_2 = 0x26,
+    OBJ_PRE_ROCKFORD_3 = 0x27,
+    OBJ_PRE_ROCKFORD_4 = 0x28,
+    OBJ_BUTTERFLY_DOWN = 0x30,
+    OBJ_BUTTERFLY_LEFT = 0x31,
+    OBJ_BUTTERFLY_UP = 0x32,
+    OBJ_BUTTERFLY_RIGHT = 0x33,
+    OBJ_BUTTERFLY_DOWN_SCANNED = OBJ_BUTTERFLY_DOWN | OBJ_SCANNED,
+    OBJ_BUTTERFLY_LEFT_SCANNED = OBJ_BUTTERFLY_LEFT | OBJ_SCANNED,
+    OBJ_BUTTERFLY_UP_SCANNED = OBJ_BUTTERFLY_UP | OBJ_SCANNED,
+    OBJ_BUTTERFLY_RIGHT_SCANNED = OBJ_BUTTERFLY_RIGHT | OBJ_SCANNED,
+    OBJ_ROCKFORD = 0x38,
+    OBJ_ROCKFORD_SCANNED = OBJ_ROCKFORD | OBJ_SCANNED,
+    OBJ_AMOEBA = 0x3A,
+    OBJ_AMOEBA_SCANNED = OBJ_AMOEBA | OBJ_SCANNED,
+} Object;
+
+// Size of the original caves, used when the cave data leaves it at zero.
+// Cave data can give any size up to 255x255.
+#define CAVE_HEIGHT 22
+#define CAVE_WIDTH 40
+
+// The map is stored flat, row by row, inside a one cell sentinel border of
+// steel wall, so every neighbour of a cave cell is a single add away and
+// always in bounds. The stride is the cave width plus the border.
+#define CAVE_STRIDE (CAVE_WIDTH + 2)
+#define CAVE_MAP_SIZE ((CAVE_HEIGHT + 2) * CAVE_STRIDE)
+#define CELL_INDEX(state, row, col) (((row) + 1) * (state)->caveStride + (col) + 1)
+#define CELL_ROW(state, cell) ((cell) / (state)->caveStride - 1)
+#define CELL_COL(state, cell) ((cell) % (state)->caveStride - 1)
+#define NUM_DIFFICULTY_LEVELS 5
+#define NUM_RANDOM_OBJECTS 4
+
+typedef struct
+{
+    uint8_t caveNumber;
+    uint8_t magicWallMillingTime; // also amoebaSlowGrowthTime
+    uint8_t initialDiamondValue;
+    uint8_t extraDiamondValue;
+    uint8_t randomiserSeed[NUM_DIFFICULTY_LEVELS];
+    uint8_t diamondsNeeded[NUM_DIFFICULTY_LEVELS];
+    uint8_t caveTime[NUM_DIFFICULTY_LEVELS];
+    uint8_t backgroundColor1;
+    uint8_t backgroundColor2;
+    uint8_t foregroundColor;
+    uint8_t caveWidth;      // Zero for CAVE_WIDTH
+    uint8_t caveHeight;     // Zero for CAVE_HEIGHT
+    uint8_t randomObject[NUM_RANDOM_OBJECTS];
+    uint8_t objectProbability[NUM_RANDOM_OBJECTS];
+} CaveInfo;
+
+typedef enum
+{
+    CAVE_A,
+    CAVE_B,
+    CAVE_C,
+    CAVE_D,
+    INTERMISSION_1,
+    CAVE_E,
+    CAVE_F,
+    CAVE_G,
+    CAVE_H,
+    INTERMISSION_2,
+    CAVE_I,
+    CAVE_J,
+    CAVE_K,
+    CAVE_L,
+    INTERMISSION_3,
+    CAVE_M,
+    CAVE_N,
+    CAVE_O,
+    CAVE_P,
+    INTERMISSION_4,
+    CAVE_COUNT,
+} CaveName;
+
+typedef enum
+{
+    MAGIC_WALL_OFF, MAGIC_WALL_ON, MAGIC_WALL_EXPIRED
+} MagicWallStatus;
+
+//
+// Game state
+//
+// Everything the simulation reads and writes between ticks lives here.
+// The map, active set and cell cover of caves no bigger than the original
+// ones are stored in the struct itself, bigger caves get them from a heap
+// block the state owns. map, activeCells and cellCover point at whichever
+// is in use, so a running game is cloned or restored with cloneGameState,
+// never by copying the struct.
+//
+
+typedef struct
+{
+    uint8_t *map;                       // Indexed by CELL_INDEX
+    uint64_t *activeCells;              // Cells the scan visits, bit per map index
+    uint64_t *cellCover;                // coverStride words per row, bit per column
+    uint32_t tileCover[ PLAYFIELD_HEIGHT_IN_TILES ];            // One bit per column
+    CaveInfo *caveInfo;
+    uint32_t randomState;
+
+    int startCave;
+    int startDifficultyLevel;
+    int loadedCaveNumber;
+    int caveWidth;
+    int caveHeight;
+    int caveStride;
+    int coverStride;
+
+    int turn;
+    int tick;
+
+    bool isGameStart;
+    int turnsTillGameRestart;
+    int turnsTillExitingCave;
+    bool isAddingTimeToScore;
+
+    Color borderColor;
+
+    int cameraX;
+    int cameraY;
+    int cameraVelX;
+    int cameraVelY;
+
+    // Initialised when game starts
+    bool isCaveStart;
+    int pauseTurnsLeft;
+    int livesLeft;
+    int difficultyLevel;
+    int score;
+    int scoreTillBonusLife;
+    int spaceFlashingTurnsLeft;
+    int currentCaveNumber;
+
+    // Initialised when cave starts
+    bool isExitingCave;
+    bool isOutOfTime;
+    int turnsSinceRockfordSeenAlive;
+    int caveTimeLeft;
+    int ticksTillNextCaveSecond;
+    bool isOutOfTimeTextShown;
+    int outOfTimeTurn;
+    int diamondsCollected;
+    int currentDiamondValue;
+    int rockfordTurnsTillBirth;
+    int cellCoverTurnsLeft;
+    int tileCoverTicksLeft;
+    MagicWallStatus magicWallStatus;
+
+    int rockfordCol;
+    int rockfordRow;
+    bool rockfordIsBlinking;
+    bool rockfordIsTapping;
+    bool rockfordIsMoving;
+    bool rockfordHasSnapped;        // Cleared the cell next to him with fire held this turn
+    bool rockfordIsFacingRight;
+
+    int amoebaSlowGrowthTimeLeft;
+    int magicWallMillingTimeLeft;
+
+    int numberOfAmoebaFoundThisTurn;
+    int totalAmoebaFoundLastTurn;
+    bool amoebaSuffocatedLastTurn;
+    bool atLeastOneAmoebaFoundThisTurnWhichCanGrow;
+
+    // Storage behind map, activeCells and cellCover
+    uint8_t *largeCave;                 // Heap block for caves bigger than the original, owned by the state
+    size_t largeCaveCapacity;
+    alignas(CACHE_LINE_SIZE) uint8_t caveMap[ CAVE_MAP_SIZE ];
+    uint64_t caveActiveCells[ (CAVE_MAP_SIZE + 63) / 64 ];
+    uint64_t caveCellCover[ CAVE_HEIGHT ];
+
+} GameState;
+
+void setCaveSize(int caveIndex, int width, int height);
+void initGameState(GameState *state, int startCave, int startDifficultyLevel, uint32_t seed);
+void cloneGameState(GameState *dst, const GameState *src);
+void freeGameState(GameState *state);
+void stepGame(GameState *state, Input input);
+uint64_t hashGameState(const GameState *state);
+
+bool isCellCovered(const GameState *state, int row, int col);
+bool isTileCovered(const GameState *state, int row, int col);
+bool isIntermission(const GameState *state);
+char getCurrentCaveLetter(const GameState *state);
+
+#endif /* SIMULATION_H_ */
@@ -1,69 +1,84 @@
-inline UINT32 power(UINT32 base, UINT32 exponent) {
-  UINT32 result = 1;
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <SDL2/SDL.h>
+
+#include "sound.h"
+#include "util.h"
+
+/*
+ * Square wave synth for the game's sound effects, played through an SDL
+ * audio device. Everything below the ring is touched by the audio thread
+ * only.
+ */
+
+#ifndef ARRAY_LENGTH
+#define ARRAY_LENGTH(array) ((int)(sizeof(array)/sizeof(*array)))
+#endif
+
+#define PI 3.14159265359f
+#define TWO_PI 6.28318530718f
+
+static inline uint32_t power(uint32_t base, uint32_t exponent) {
+  uint32_t result = 1;
   while (exponent-- > 0) result *= base;
   return result;
 }
 
-static void initializeSoundSystem(SoundSystem *sys, float bufferDurationSec, float tickDuration) {
-  //
-  // Initialize WASAPI
-  //
-
-  HRESULT hr;
-
-  IMMDeviceEnumerator *enumerator;
-  CoInitialize(NULL);
-  hr = CoCreateInstance(&CLSID_MMDeviceEnumerator, NULL, CLSCTX_ALL, &IID_IMMDeviceEnumerator, (void**)&enumerator);
-  assert(SUCCEEDED(hr));
-
-  IMMDevice *device;
-  hr = enumerator->lpVtbl->GetDefaultAudioEndpoint(enumerator, eRender, eConsole, &device);
-  assert(SUCCEEDED(hr));
-
-  IAudioClient *audioClient;
-  hr = device->lpVtbl->Activate(device, &IID_IAudioClient, CLSCTX_ALL, NULL, (void**)&audioClient);
-  assert(SUCCEEDED(hr));
-
-  WAVEFORMATEX *mixFormat;
-  hr = audioClient->lpVtbl->GetMixFormat(audioClient, &mixFormat);
-  assert(SUCCEEDED(hr));
-
-  WAVEFORMATEX waveFormat;
-  memcpy(&waveFormat, mixFormat, sizeof(WAVEFORMATEX));
-  waveFormat.wFormatTag = WAVE_FORMAT_PCM;
-  waveFormat.cbSize = 0;
-
-  REFERENCE_TIME duration = (REFERENCE_TIME)(bufferDurationSec*REFTIMES_PER_SEC);
-  hr = audioClient->lpVtbl->Initialize(audioClient, AUDCLNT_SHAREMODE_SHARED, 0, duration, 0, &waveFormat, NULL);
-  assert(SUCCEEDED(hr));
-
-  UINT32 bufferFramesCount;
-  hr = audioClient->lpVtbl->GetBufferSize(audioClient, &bufferFramesCount);
-  assert(SUCCEEDED(hr));
-
-  IAudioRenderClient *renderClient;
-  hr = audioClient->lpVtbl->GetService(audioClient, &IID_IAudioRenderClient, (void**)&renderClient);
-  assert(SUCCEEDED(hr));
-
-  sys->audioClient = audioClient;
-  sys->renderClient = renderClient;
-  sys->bufferFramesCount = bufferFramesCount;
-  sys->maxIntegerSampleValue = power(2, waveFormat.wBitsPerSample - 1) - 1;
-  sys->bytesPerSample = waveFormat.wBitsPerSample / 8;
-  sys->channelsCount = waveFormat.nChannels;
-  sys->samplesPerSecond = waveFormat.nSamplesPerSec;
+static void outputSound(void *userdata, Uint8 *stream, int len);
+
+// Returns false, leaving the game silent, when there is no audio device
+bool initializeSoundSystem(SoundSystem *sys, float bufferDurationSec, float tickDuration) {
+  memset(sys, 0, sizeof(*sys));
+
+  if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+    printf("SDL audio could not initialise! SDL_Error: %s\n", SDL_GetError());
+    return false;
+  }
+
+  SDL_AudioSpec wanted = { 0 };
+  wanted.freq = 44100;
+  wanted.format = AUDIO_S16SYS;
+  wanted.channels = 2;
+  wanted.samples = 1;
+  while (wanted.samples < bufferDurationSec * wanted.freq) {
+    wanted.samples *= 2;
+  }
+  wanted.callback = outputSound;
+  wanted.userdata = sys;
+
+  SDL_AudioSpec obtained;
+  int allowedChanges = SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE;
+  SDL_AudioDeviceID device = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained, allowedChanges);
+  if (!device) {
+    printf("Could not open audio device! SDL_Error: %s\n", SDL_GetError());
+    return false;
+  }
+
+  sys->device = device;
+  sys->bufferFramesCount = obtained.samples;
+  sys->maxIntegerSampleValue = power(2, 16 - 1) - 1;
+  sys->channelsCount = obtained.channels;
+  sys->samplesPerSecond = obtained.freq;
   sys->tickDuration = tickDuration;
   sys->initialAddingTimeToScoreSoundFrequency = 200.0f;
   sys->addingTimeToScoreSoundFrequency = sys->initialAddingTimeToScoreSoundFrequency;
   sys->addingTimeToScoreSoundFrequencyStep = 5.0f;
 
-  audioClient->lpVtbl->Start(audioClient);
+  SDL_PauseAudioDevice(device, 0);
+  return true;
 }
 
-static void fillNoiseBuffer(Sound *sound) {
-  for (int i = 0; i < ARRAY_LENGTH(sound->noise); ++i) {
-    sound->noise[i] = 2.0f*((float)rand()/(float)RAND_MAX) - 1.0f;
+static bool isSoundPlaying(SoundSystem *sys, SoundID soundId) {
+  for (int soundIndex = 0; soundIndex < ARRAY_LENGTH(sys->sounds); ++soundIndex) {
+    if (sys->sounds[soundIndex].isPlaying && sys->sounds[soundIndex].id == soundId) {
+      return true;
+    }
   }
+  return false;
 }
 
 static void playSound(SoundSystem *sys, SoundID soundId) {
@@ -113,7 +128,12 @@ static void playSound(SoundSystem *sys, SoundID soundId) {
         amplitude = 0.1f;
         break;
       case SND_ADDING_TIME_TO_SCORE:
+        // Rises with every tick of time added, starting again from the bottom each cave
+        if (!isSoundPlaying(sys, SND_ADDING_TIME_TO_SCORE)) {
+          sys->addingTimeToScoreSoundFrequency = sys->initialAddingTimeToScoreSoundFrequency;
+        }
         baseFrequency = sys->addingTimeToScoreSoundFrequency;
+        sys->addingTimeToScoreSoundFrequency += sys->addingTimeToScoreSoundFrequencyStep;
         baseDuration = 1.0f;
         amplitude = 0.2f;
         break;
@@ -156,6 +176,7 @@ static void playSound(SoundSystem *sys, SoundID soundId) {
     toneFrequency = baseFrequency + freqVariance*(rand()/(float)RAND_MAX) - freqVariance;
     soundDurationSec = sys->tickDuration*(baseDuration + durationVariance*(rand()/(float)RAND_MAX) - durationVariance);
 
+    freeSound->id = soundId;
     freeSound->isPlaying = true;
     freeSound->phase = 0;
     freeSound->phaseStep = TWO_PI*toneFrequency / sys->samplesPerSecond;
@@ -166,20 +187,33 @@ static void playSound(SoundSystem *sys, SoundID soundId) {
   }
 }
 
-static void outputSound(SoundSystem *sys) {
-  HRESULT hr;
+// SDL audio callback, runs on the audio thread
+static void outputSound(void *userdata, Uint8 *stream, int len) {
+  SoundSystem *sys = userdata;
+
+  // A sound that was already due when the last callback ran belonged in
+  // that callback's buffer: the queue ran short and it played late
+  uint64_t now = timer_tick();
+  bool isLate = false;
 
-  UINT32 paddingFramesCount;
-  hr = sys->audioClient->lpVtbl->GetCurrentPadding(sys->audioClient, &paddingFramesCount);
-  assert(SUCCEEDED(hr));
+  unsigned tail = atomic_load_explicit(&sys->queue.tail, memory_order_relaxed);
+  unsigned head = atomic_load_explicit(&sys->queue.head, memory_order_acquire);
+  for (; tail != head; ++tail) {
+    const SoundEvent *event = &sys->queue.events[tail & (SOUND_QUEUE_SIZE - 1)];
+    isLate |= event->dueTime < sys->lastCallbackTime;
+    playSound(sys, event->id);
+  }
+  atomic_store_explicit(&sys->queue.tail, tail, memory_order_release);
 
-  UINT32 availableFramesCount = sys->bufferFramesCount - paddingFramesCount;
+  if (isLate) {
+    atomic_fetch_add_explicit(&sys->underrunCount, 1, memory_order_relaxed);
+  }
+  sys->lastCallbackTime = now;
 
-  BYTE *buffer;
-  hr = sys->renderClient->lpVtbl->GetBuffer(sys->renderClient, availableFramesCount, &buffer);
-  assert(SUCCEEDED(hr));
+  Sint16 *buffer = (Sint16 *)stream;
+  int framesCount = len / (int)(sizeof(Sint16) * sys->channelsCount);
 
-  for (UINT32 frame = 0, b = 0; frame < availableFramesCount; ++frame) {
+  for (int frame = 0, b = 0; frame < framesCount; ++frame) {
     float fval = 0;
     for (int soundIndex = 0; soundIndex < ARRAY_LENGTH(sys->sounds); ++soundIndex) {
       Sound *sound = &sys->sounds[soundIndex];
@@ -190,7 +224,7 @@ static void outputSound(SoundSystem *sys) {
           sound->phase -= TWO_PI;
         }
         sound->samplesLeftToPlay--;
-        if (sound->samplesLeftToPlay == 0) {
+        if (sound->samplesLeftToPlay <= 0) {
           sound->isPlaying = false;
         }
       }
@@ -202,17 +236,44 @@ static void outputSound(SoundSystem *sys) {
       fval = -1.0f;
     }
 
-    // If fval is 1.0f, an overflow of INT32 is going to happen when we multiply
-    // by maxSampleVal. To avoid this, we multiply by amplitude which is less
-    // than 1.
+    // Keep some headroom below the largest sample value
     float amplitude = 0.7f;
-    INT32 val = (INT32)(fval * amplitude * sys->maxIntegerSampleValue);
+    Sint16 val = (Sint16)(fval * amplitude * sys->maxIntegerSampleValue);
 
     for (int channel = 0; channel < sys->channelsCount; ++channel)
-      for (int byte = 0; byte < sys->bytesPerSample; ++byte)
-        buffer[b++] = (val >> (byte * 8)) & 0xFF;
+      buffer[b++] = val;
+  }
+}
+
+// Called from the game thread only. Never blocks: a sound posted while the
+// queue is full is dropped and counted.
+void postSound(SoundSystem *sys, SoundID soundId, uint64_t dueTime) {
+  if (!sys->device) {
+    return;
   }
 
-  hr = sys->renderClient->lpVtbl->ReleaseBuffer(sys->renderClient, availableFramesCount, 0);
-  assert(SUCCEEDED(hr));
+  unsigned head = atomic_load_explicit(&sys->queue.head, memory_order_relaxed);
+  unsigned tail = atomic_load_explicit(&sys->queue.tail, memory_order_acquire);
+  if (head - tail == SOUND_QUEUE_SIZE) {
+    atomic_fetch_add_explicit(&sys->droppedCount, 1, memory_order_relaxed);
+    return;
+  }
+
+  sys->queue.events[head & (SOUND_QUEUE_SIZE - 1)] = (SoundEvent){ dueTime, (uint8_t)soundId };
+  atomic_store_explicit(&sys->queue.head, head + 1, memory_order_release);
+}
+
+void closeSoundSystem(SoundSystem *sys) {
+  if (!sys->device) {
+    return;
+  }
+
+  SDL_CloseAudioDevice(sys->device);
+  sys->device = 0;
+
+  int underruns = atomic_load(&sys->underrunCount);
+  int dropped = atomic_load(&sys->droppedCount);
+  if (underruns || dropped) {
+    printf("Sound: %d buffer underruns, %d sounds dropped\n", underruns, dropped);
+  }
 }
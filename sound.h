@@ -1,15 +1,10 @@
-#include <mmdeviceapi.h>
-#include <audioclient.h>
-#include <math.h>
+#ifndef SOUND_H_
+#define SOUND_H_
 
-const GUID CLSID_MMDeviceEnumerator = {0xBCDE0395, 0xE52F, 0x467C, 0x8E, 0x3D, 0xC4, 0x57, 0x92, 0x91, 0x69, 0x2E};
-const GUID IID_IMMDeviceEnumerator = {0xA95664D2, 0x9614, 0x4F35, 0xA7, 0x46, 0xDE, 0x8D, 0xB6, 0x36, 0x17, 0xE6};
-const GUID IID_IAudioClient = {0x1CB9AD4C, 0xDBFA, 0x4c32, 0xB1, 0x78, 0xC2, 0xF5, 0x68, 0xA7, 0x03, 0xB2};
-const GUID IID_IAudioRenderClient = {0xF294ACFC, 0x3146, 0x4483, 0xA7, 0xBF, 0xAD, 0xDC, 0xA7, 0xC2, 0x60, 0xE2};
-
-#define REFTIMES_PER_SEC 10000000
-#define PI 3.14159265359f
-#define TWO_PI 6.28318530718f
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 
 typedef enum {
   SND_ROCKFORD_MOVE_SPACE,
@@ -25,25 +20,50 @@ typedef enum {
 } SoundID;
 
 typedef struct {
+  SoundID id;
   bool isPlaying;
   float phase;
   float phaseStep;
   int samplesLeftToPlay;
   float amplitude;
-  float noise[32];
 } Sound;
 
+// The game thread posts sounds into a lock-free single producer, single
+// consumer ring and never waits for the audio thread, which takes them
+// out at the start of each callback. Each carries the timer_tick() time
+// it was due, the tick that made it.
+#define SOUND_QUEUE_SIZE 64 // Power of two
+
+typedef struct {
+  uint64_t dueTime;
+  uint8_t id;
+} SoundEvent;
+
 typedef struct {
-  IAudioClient *audioClient;
-  IAudioRenderClient *renderClient;
-  UINT32 bufferFramesCount;
-  INT32 maxIntegerSampleValue;
-  int bytesPerSample;
+  SoundEvent events[SOUND_QUEUE_SIZE];
+  alignas(64) atomic_uint head; // Written by the game thread only
+  alignas(64) atomic_uint tail; // Written by the audio thread only
+} SoundQueue;
+
+typedef struct {
+  uint32_t device; // SDL audio device, 0 when there is no sound
+  int32_t maxIntegerSampleValue;
   int channelsCount;
   int samplesPerSecond;
+  int bufferFramesCount;
   float tickDuration;
   Sound sounds[3];
   float initialAddingTimeToScoreSoundFrequency;
   float addingTimeToScoreSoundFrequency;
   float addingTimeToScoreSoundFrequencyStep;
+  SoundQueue queue;
+  uint64_t lastCallbackTime;
+  atomic_int underrunCount; // Callbacks that found a sound due but not yet queued
+  atomic_int droppedCount;  // Sounds posted while the queue was full
 } SoundSystem;
+
+bool initializeSoundSystem(SoundSystem *sys, float bufferDurationSec, float tickDuration);
+void postSound(SoundSystem *sys, SoundID soundId, uint64_t dueTime);
+void closeSoundSystem(SoundSystem *sys);
+
+#endif /* SOUND_H_ */
@@ -1,7 +1,9 @@
 #include "util.h"
 #include "game.h"
 
+#include <stdio.h>
 #include <time.h>
+#include <errno.h>
 
 uint64_t timer_tick( void )
 {
@@ -25,3 +27,64 @@ uint64_t timer_get_relative(uint64_t timer)
 {
     return timer_tick() - timer;
 }
+
+/* Sleeps until timer_tick() reaches the deadline */
+void timer_sleep_until(uint64_t deadline)
+{
+    struct timespec ts;
+
+#if defined(__linux__)
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+
+    while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR )
+    {
+    }
+#else
+    uint64_t now = timer_tick();
+    while( now < deadline )
+    {
+        ts.tv_sec = (deadline - now) / 1000000000;
+        ts.tv_nsec = (deadline - now) % 1000000000;
+        (void)nanosleep( &ts, NULL );
+        now = timer_tick();
+    }
+#endif
+}
+
+void latency_record(latency_histogram *histogram, uint64_t nanoseconds)
+{
+    uint64_t bucket = nanoseconds / LATENCY_BUCKET_NS;
+
+    ++histogram->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1];
+    ++histogram->count;
+    if( nanoseconds > histogram->max )
+    {
+        histogram->max = nanoseconds;
+    }
+}
+
+/* Upper bound of the bucket the percentile falls in, never above the maximum */
+uint64_t latency_percentile(const latency_histogram *histogram, int percent)
+{
+    uint64_t rank = (histogram->count * percent + 99) / 100;
+    uint64_t seen = 0;
+
+    for( int i = 0; i < LATENCY_BUCKETS; ++i )
+    {
+        seen += histogram->buckets[i];
+        if( seen >= rank && seen > 0 )
+        {
+            uint64_t bound = (uint64_t)(i + 1) * LATENCY_BUCKET_NS;
+            return bound < histogram->max ? bound : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void latency_print(const latency_histogram *histogram, const char *name)
+{
+    printf( "%s: %llu samples, p50 %.1f ms, p99 %.1f ms, max %.1f ms\n", name,
+            (unsigned long long)histogram->count, latency_percentile( histogram, 50 ) / 1e6,
+            latency_percentile( histogram, 99 ) / 1e6, histogram->max / 1e6 );
+}
@@ -12,5 +12,21 @@ int dist(int, int, int, int);
 uint64_t timer_tick(void);
 void timer_start(uint64_t *timer);
 uint64_t timer_get_relative(uint64_t timer);
+void timer_sleep_until(uint64_t deadline);
 uint32_t get_centre_x(uint32_t);
+
+/* Latencies in 0.1 ms buckets up to 500 ms, anything longer lands in the last one */
+#define LATENCY_BUCKET_NS 100000
+#define LATENCY_BUCKETS 5000
+
+typedef struct
+{
+    uint32_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+} latency_histogram;
+
+void latency_record(latency_histogram *histogram, uint64_t nanoseconds);
+uint64_t latency_percentile(const latency_histogram *histogram, int percent);
+void latency_print(const latency_histogram *histogram, const char *name);
 #endif